@@ -0,0 +1,77 @@
+#include "backup.h"
+
+#include <iostream>
+
+Backup::~Backup()
+{
+	if (_thread.joinable())
+		_thread.join();
+}
+
+bool Backup::start(std::string target, bool compact)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_progress.running)
+		return false;
+	if (_thread.joinable())
+		_thread.join();
+
+	_progress = Progress{};
+	_progress.running = true;
+	_progress.target = target;
+	_progress.compact = compact;
+	_progress.started = Clock::now();
+	_thread = std::thread([this, target = std::move(target), compact] { _run(target, compact); });
+	return true;
+}
+
+Backup::Progress Backup::progress()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _progress;
+}
+
+void Backup::_run(std::string target, bool compact)
+{
+	std::string error;
+	sqlite3* destination = nullptr;
+	if (sqlite3_open_v2(target.c_str(), &destination, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+		error = sqlite3_errmsg(destination);
+	else if (auto backup = sqlite3_backup_init(destination, "main", _db->_handle.get(), "main"))
+	{
+		int rc;
+		do
+		{
+			{
+				// Never step inside another thread's open transaction
+				std::lock_guard<std::recursive_mutex> writer(_db->_writer);
+				rc = sqlite3_backup_step(backup, _settings.pages_per_step);
+			}
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_progress.remaining = sqlite3_backup_remaining(backup);
+				_progress.total = sqlite3_backup_pagecount(backup);
+			}
+			if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+				std::this_thread::sleep_for(_settings.pause);
+		} 
+		while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+
+		if (sqlite3_backup_finish(backup) != SQLITE_OK)
+			error = sqlite3_errmsg(destination);
+		else if (compact && sqlite3_exec(destination, "VACUUM", nullptr, nullptr, nullptr) != SQLITE_OK)
+			error = sqlite3_errmsg(destination);
+	}
+	else
+		error = sqlite3_errmsg(destination);
+	sqlite3_close(destination);
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_progress.running = false;
+	_progress.error = std::move(error);
+	_progress.finished = Clock::now();
+	if (_progress.error.empty())
+		std::cout << "backup of " << _progress.total << " pages written to " << target << "\n";
+	else
+		std::cout << "backup to " << target << " failed: " << _progress.error << "\n";
+}
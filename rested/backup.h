@@ -0,0 +1,56 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "pointers.h"
+#include "database.h"
+
+// Copies the live database into a file while the server keeps running. Each
+// step copies a few pages under the writer lock, then sleeps, so that writes
+// are only ever held up by one short step. Writes made through the same
+// connection in the meantime are carried over into the copy.
+class Backup
+{
+public:
+	using Clock = std::chrono::system_clock;
+
+	struct Settings
+	{
+		int pages_per_step = 64;
+		std::chrono::milliseconds pause{ 10 };
+	};
+
+	struct Progress
+	{
+		bool running = false;
+		std::string target;
+		bool compact = false;
+		int remaining = 0;
+		int total = 0;
+		std::string error;
+		Clock::time_point started;
+		Clock::time_point finished;
+	};
+private:
+	shared<db::Database> _db;
+	const Settings _settings;
+
+	std::mutex _mutex;
+	Progress _progress;
+	std::thread _thread;
+
+	void _run(std::string target, bool compact);
+public:
+	Backup(shared<db::Database> db, Settings settings) : _db(std::move(db)), _settings(settings) { }
+	Backup(shared<db::Database> db) : Backup(std::move(db), Settings{}) { }
+	~Backup();
+
+	// Starts copying into target; a compact copy is vacuumed once complete,
+	// which drops its free pages. Returns false while another backup runs.
+	bool start(std::string target, bool compact);
+
+	Progress progress();
+};
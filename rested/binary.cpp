@@ -0,0 +1,486 @@
+#include "binary.h"
+
+#include <cmath>
+#include <limits>
+#include <istream>
+#include <algorithm>
+#include <stdexcept>
+
+namespace binary
+{
+	std::optional<Format> format(std::string_view media_type)
+	{
+		media_type = media_type.substr(0, media_type.find(';'));
+		while (!media_type.empty() && isspace(static_cast<unsigned char>(media_type.back())))
+			media_type.remove_suffix(1);
+		while (!media_type.empty() && isspace(static_cast<unsigned char>(media_type.front())))
+			media_type.remove_prefix(1);
+		auto is = [&](std::string_view name)
+		{
+			return media_type.size() == name.size() && std::equal(name.begin(), name.end(), media_type.begin(),
+				[](char a, char b) { return a == tolower(static_cast<unsigned char>(b)); });
+		};
+		if (is("application/msgpack") || is("application/x-msgpack") || is("application/vnd.msgpack"))
+			return Format::MessagePack;
+		if (is("application/cbor"))
+			return Format::Cbor;
+		return std::nullopt;
+	}
+
+	void Writer::_big(uint64_t value, unsigned bytes)
+	{
+		for (unsigned shift = 8 * bytes; shift != 0; )
+		{
+			shift -= 8;
+			_byte(unsigned(value >> shift) & 0xFF);
+		}
+	}
+	void Writer::_head(unsigned major, uint64_t value)
+	{
+		major <<= 5;
+		if (value < 24)
+			_byte(major | unsigned(value));
+		else if (value <= 0xFF)
+		{
+			_byte(major | 24);
+			_big(value, 1);
+		}
+		else if (value <= 0xFFFF)
+		{
+			_byte(major | 25);
+			_big(value, 2);
+		}
+		else if (value <= 0xFFFFFFFF)
+		{
+			_byte(major | 26);
+			_big(value, 4);
+		}
+		else
+		{
+			_byte(major | 27);
+			_big(value, 8);
+		}
+	}
+	void Writer::_count(uint64_t count, unsigned fixed, unsigned fixed_max, unsigned marker8, unsigned marker16, unsigned marker32)
+	{
+		if (count <= fixed_max)
+			_byte(fixed | unsigned(count));
+		else if (marker8 && count <= 0xFF)
+		{
+			_byte(marker8);
+			_big(count, 1);
+		}
+		else if (count <= 0xFFFF)
+		{
+			_byte(marker16);
+			_big(count, 2);
+		}
+		else if (count <= 0xFFFFFFFF)
+		{
+			_byte(marker32);
+			_big(count, 4);
+		}
+		else
+			throw std::length_error("Too many elements for MessagePack");
+	}
+
+	void Writer::null()
+	{
+		_byte(_format == Format::MessagePack ? 0xC0 : 0xF6);
+	}
+	void Writer::boolean(bool value)
+	{
+		if (_format == Format::MessagePack)
+			_byte(value ? 0xC3 : 0xC2);
+		else
+			_byte(value ? 0xF5 : 0xF4);
+	}
+	void Writer::integer(long long value)
+	{
+		if (_format == Format::Cbor)
+			return value >= 0 ? _head(0, uint64_t(value)) : _head(1, uint64_t(-1 - value));
+
+		// The smallest of MessagePack's integer types that holds the value
+		if (value >= 0)
+		{
+			if (value <= 0x7F)
+				return _byte(unsigned(value));
+			const unsigned bytes = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : value <= 0xFFFFFFFF ? 4 : 8;
+			_byte(bytes == 1 ? 0xCC : bytes == 2 ? 0xCD : bytes == 4 ? 0xCE : 0xCF);
+			_big(uint64_t(value), bytes);
+		}
+		else
+		{
+			if (value >= -32)
+				return _byte(unsigned(value) & 0xFF);
+			const unsigned bytes = value >= INT8_MIN ? 1 : value >= INT16_MIN ? 2 : value >= INT32_MIN ? 4 : 8;
+			_byte(bytes == 1 ? 0xD0 : bytes == 2 ? 0xD1 : bytes == 4 ? 0xD2 : 0xD3);
+			_big(uint64_t(value), bytes);
+		}
+	}
+	void Writer::number(double value)
+	{
+		uint64_t bits;
+		std::copy_n(reinterpret_cast<const char*>(&value), sizeof(bits), reinterpret_cast<char*>(&bits));
+		_byte(_format == Format::MessagePack ? 0xCB : 0xFB);
+		_big(bits, 8);
+	}
+	void Writer::string(std::string_view text)
+	{
+		if (_format == Format::MessagePack)
+			_count(text.size(), 0xA0, 31, 0xD9, 0xDA, 0xDB);
+		else
+			_head(3, text.size());
+		_out.append(text);
+	}
+	void Writer::array(size_t count)
+	{
+		if (_format == Format::MessagePack)
+			_count(count, 0x90, 15, 0, 0xDC, 0xDD);
+		else
+			_head(4, count);
+	}
+	void Writer::map(size_t count)
+	{
+		if (_format == Format::MessagePack)
+			_count(count, 0x80, 15, 0, 0xDE, 0xDF);
+		else
+			_head(5, count);
+	}
+
+	size_t Writer::beginArray()
+	{
+		// A four byte count, whatever it turns out to be: array 32 or a CBOR array with a 32 bit length
+		const size_t start = _out.size();
+		_byte(_format == Format::MessagePack ? 0xDD : 0x9A);
+		_big(0, 4);
+		return start;
+	}
+	void Writer::endArray(size_t start, size_t count)
+	{
+		if (count > 0xFFFFFFFF)
+			throw std::length_error("Too many elements for a four byte count");
+		for (unsigned i = 0; i < 4; ++i)
+			_out[start + 1 + i] = char(count >> (24 - 8 * i) & 0xFF);
+	}
+
+	namespace
+	{
+		class Error : public std::runtime_error
+		{
+		public:
+			using std::runtime_error::runtime_error;
+		};
+
+		// Deeper than this is no data of ours, and would only use up the stack
+		constexpr size_t max_depth = 512;
+		// Strings are read this much at a time, so that a length the data does not
+		// back up runs into its end before allocating much
+		constexpr size_t piece_size = 1 << 16;
+
+		double half(unsigned bits)
+		{
+			const int exponent = int(bits >> 10 & 0x1F);
+			const unsigned mantissa = bits & 0x3FF;
+			double value;
+			if (exponent == 0)
+				value = std::ldexp(double(mantissa), -24);
+			else if (exponent != 31)
+				value = std::ldexp(double(mantissa + 1024), exponent - 25);
+			else
+				value = mantissa == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+			return bits & 0x8000 ? -value : value;
+		}
+
+		class Reader
+		{
+			std::istream& _in;
+			const Format _format;
+			json::Handler& _handler;
+			std::string _text;
+			size_t _depth = 0;
+
+			uint64_t _big(unsigned bytes)
+			{
+				uint64_t value = 0;
+				while (bytes-- != 0)
+					value = value << 8 | byte();
+				return value;
+			}
+			void _append(uint64_t size)
+			{
+				for (uint64_t left = size; left != 0; )
+				{
+					const size_t piece = size_t(std::min<uint64_t>(left, piece_size));
+					const size_t at = _text.size();
+					_text.resize(at + piece);
+					if (!_in.read(_text.data() + at, std::streamsize(piece)))
+						throw Error("Unexpected end of data");
+					left -= piece;
+				}
+			}
+			std::string_view _string(uint64_t size)
+			{
+				_text.clear();
+				_append(size);
+				return _text;
+			}
+			double _float(unsigned bytes)
+			{
+				const uint64_t bits = _big(bytes);
+				if (bytes == 2)
+					return half(unsigned(bits));
+				if (bytes == 4)
+				{
+					float value;
+					const auto word = uint32_t(bits);
+					std::copy_n(reinterpret_cast<const char*>(&word), sizeof(value), reinterpret_cast<char*>(&value));
+					return value;
+				}
+				double value;
+				std::copy_n(reinterpret_cast<const char*>(&bits), sizeof(value), reinterpret_cast<char*>(&value));
+				return value;
+			}
+			// An unsigned integer, or the n of the negative CBOR integer -1 - n
+			void _integer(uint64_t value, bool negative)
+			{
+				if (value > uint64_t(std::numeric_limits<long long>::max()))
+					throw Error("Number out of range");
+				_handler.onInteger(negative ? -1 - (long long)value : (long long)value);
+			}
+			void _enter()
+			{
+				if (++_depth > max_depth)
+					throw Error("Nesting too deep");
+			}
+
+			// MessagePack
+			void _array(uint64_t count)
+			{
+				_enter();
+				_handler.onBeginArray();
+				while (count-- != 0)
+					value(byte());
+				_handler.onEndArray();
+				--_depth;
+			}
+			void _map(uint64_t count)
+			{
+				_enter();
+				_handler.onBeginObject();
+				while (count-- != 0)
+				{
+					const unsigned first = byte();
+					if (first >= 0xA0 && first <= 0xBF)
+						_handler.onKey(_string(first & 0x1F));
+					else if (first >= 0xD9 && first <= 0xDB)
+						_handler.onKey(_string(_big(1u << (first - 0xD9))));
+					else
+						throw Error("Map keys have to be strings");
+					value(byte());
+				}
+				_handler.onEndObject();
+				--_depth;
+			}
+			void _packed(unsigned first)
+			{
+				if (first <= 0x7F)
+					return _handler.onInteger(first);
+				if (first >= 0xE0)
+					return _handler.onInteger(static_cast<signed char>(first));
+				if (first <= 0x8F)
+					return _map(first & 0xF);
+				if (first <= 0x9F)
+					return _array(first & 0xF);
+				if (first <= 0xBF)
+					return _handler.onString(_string(first & 0x1F));
+				switch (first)
+				{
+				case 0xC0: return _handler.onNull();
+				case 0xC2: return _handler.onBool(false);
+				case 0xC3: return _handler.onBool(true);
+				case 0xC4: case 0xC5: case 0xC6:
+					throw Error("Binary data is not supported");
+				case 0xC7: case 0xC8: case 0xC9:
+				case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8:
+					throw Error("MessagePack extension types are not supported");
+				case 0xCA: return _handler.onNumber(_float(4));
+				case 0xCB: return _handler.onNumber(_float(8));
+				case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+					return _integer(_big(1u << (first - 0xCC)), false);
+				case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+				{
+					// Sign extended from its top byte
+					const unsigned bytes = 1u << (first - 0xD0);
+					const unsigned shift = 64 - 8 * bytes;
+					return _handler.onInteger(static_cast<long long>(_big(bytes) << shift) >> shift);
+				}
+				case 0xD9: case 0xDA: case 0xDB:
+					return _handler.onString(_string(_big(1u << (first - 0xD9))));
+				case 0xDC: return _array(_big(2));
+				case 0xDD: return _array(_big(4));
+				case 0xDE: return _map(_big(2));
+				case 0xDF: return _map(_big(4));
+				default:
+					throw Error("Invalid MessagePack");
+				}
+			}
+
+			// CBOR
+			static constexpr unsigned cbor_break = 0xFF;
+			static constexpr unsigned indefinite = 31;
+
+			uint64_t _argument(unsigned info)
+			{
+				if (info < 24)
+					return info;
+				if (info < 28)
+					return _big(1u << (info - 24));
+				throw Error("Invalid CBOR");
+			}
+			// A text string, which may come in chunks
+			std::string_view _text_string(unsigned info)
+			{
+				if (info != indefinite)
+					return _string(_argument(info));
+				_text.clear();
+				for (unsigned chunk = byte(); chunk != cbor_break; chunk = byte())
+				{
+					if (chunk >> 5 != 3 || (chunk & 0x1F) == indefinite)
+						throw Error("Invalid CBOR text chunk");
+					_append(_argument(chunk & 0x1F));
+				}
+				return _text;
+			}
+			void _cbor(unsigned first)
+			{
+				const unsigned info = first & 0x1F;
+				switch (first >> 5)
+				{
+				case 0: return _integer(_argument(info), false);
+				case 1: return _integer(_argument(info), true);
+				case 2: throw Error("Binary data is not supported");
+				case 3: return _handler.onString(_text_string(info));
+				case 4:
+				{
+					_enter();
+					_handler.onBeginArray();
+					if (info == indefinite)
+						for (unsigned next = byte(); next != cbor_break; next = byte())
+							value(next);
+					else
+						for (uint64_t count = _argument(info); count != 0; --count)
+							value(byte());
+					_handler.onEndArray();
+					--_depth;
+					return;
+				}
+				case 5:
+				{
+					_enter();
+					_handler.onBeginObject();
+					const bool open = info == indefinite;
+					for (uint64_t count = open ? 0 : _argument(info); open || count != 0; --count)
+					{
+						const unsigned key = byte();
+						if (open && key == cbor_break)
+							break;
+						if (key >> 5 != 3)
+							throw Error("Map keys have to be strings");
+						_handler.onKey(_text_string(key & 0x1F));
+						value(byte());
+					}
+					_handler.onEndObject();
+					--_depth;
+					return;
+				}
+				case 6:
+					// Tags only say more about the value that follows. Each one recurses,
+					// so a chain of them counts against the depth as nesting does.
+					_argument(info);
+					_enter();
+					value(byte());
+					--_depth;
+					return;
+				default:
+					switch (info)
+					{
+					case 20: return _handler.onBool(false);
+					case 21: return _handler.onBool(true);
+					case 22: case 23: return _handler.onNull();
+					case 25: return _handler.onNumber(_float(2));
+					case 26: return _handler.onNumber(_float(4));
+					case 27: return _handler.onNumber(_float(8));
+					case indefinite: throw Error("Unexpected CBOR break");
+					default: throw Error("Unsupported CBOR simple value");
+					}
+				}
+			}
+		public:
+			Reader(std::istream& in, Format format, json::Handler& handler) : _in(in), _format(format), _handler(handler) { }
+
+			unsigned byte()
+			{
+				const auto c = _in.get();
+				if (c == std::istream::traits_type::eof())
+					throw Error("Unexpected end of data");
+				return unsigned(c);
+			}
+			bool done() { return _in.peek() == std::istream::traits_type::eof(); }
+
+			// The value that starts with the byte first
+			void value(unsigned first)
+			{
+				if (_format == Format::MessagePack)
+					_packed(first);
+				else
+					_cbor(first);
+			}
+
+			// Reads the head of an array, reporting each of its elements to the handler
+			void each()
+			{
+				const unsigned first = byte();
+				if (_format == Format::MessagePack)
+				{
+					uint64_t count;
+					if (first >= 0x90 && first <= 0x9F)
+						count = first & 0xF;
+					else if (first == 0xDC || first == 0xDD)
+						count = _big(first == 0xDC ? 2 : 4);
+					else
+						throw Error("Expected an array");
+					while (count-- != 0)
+						value(byte());
+				}
+				else
+				{
+					if (first >> 5 != 4)
+						throw Error("Expected an array");
+					if ((first & 0x1F) == indefinite)
+						for (unsigned next = byte(); next != cbor_break; next = byte())
+							value(next);
+					else
+						for (uint64_t count = _argument(first & 0x1F); count != 0; --count)
+							value(byte());
+				}
+			}
+		};
+	}
+
+	void parse(std::istream& in, Format format, json::Handler& handler)
+	{
+		Reader reader(in, format, handler);
+		reader.value(reader.byte());
+		if (!reader.done())
+			throw Error("Unexpected data after value");
+	}
+
+	void parseEach(std::istream& in, Format format, json::Handler& handler)
+	{
+		Reader reader(in, format, handler);
+		reader.each();
+		if (!reader.done())
+			throw Error("Unexpected data after array");
+	}
+}
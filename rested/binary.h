@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string_view>
+
+#include "json.h"
+
+// MessagePack and CBOR, for clients that would rather not format and parse
+// text. Both carry the same values as JSON, with integers kept as integers
+// and floating point numbers as their eight bytes.
+namespace binary
+{
+	enum class Format { MessagePack, Cbor };
+
+	// The format a media type like application/msgpack names, if any
+	std::optional<Format> format(std::string_view media_type);
+
+	// Appends encoded values to a string. Arrays and maps are preceded by
+	// their number of elements, so there is nothing to close.
+	class Writer
+	{
+		std::string& _out;
+		const Format _format;
+
+		void _byte(unsigned byte) { _out += char(byte); }
+		void _big(uint64_t value, unsigned bytes);
+		// A CBOR head: the major type and a count or value in the fewest bytes
+		void _head(unsigned major, uint64_t value);
+		// A MessagePack count, in the fixed byte when it fits or after one of three markers
+		void _count(uint64_t count, unsigned fixed, unsigned fixed_max, unsigned marker8, unsigned marker16, unsigned marker32);
+	public:
+		Writer(std::string& out, Format format) : _out(out), _format(format) { }
+
+		void null();
+		void boolean(bool value);
+		void integer(long long value);
+		void number(double value);
+		void string(std::string_view text);
+		void array(size_t count);
+		void map(size_t count);
+
+		// Starts an array whose length is known only once it is complete, to be
+		// filled in by endArray with the position returned
+		size_t beginArray();
+		void endArray(size_t start, size_t count);
+	};
+
+	// Reads a single value from in, which must hold nothing else, reporting it
+	// to the handler as json::parse would
+	void parse(std::istream& in, Format format, json::Handler& handler);
+	// Reads an array from in, reporting each element as soon as it is complete,
+	// leaving out the array itself
+	void parseEach(std::istream& in, Format format, json::Handler& handler);
+}
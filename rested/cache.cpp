@@ -0,0 +1,99 @@
+#include "cache.h"
+
+void ResultCache::_erase(List::iterator it)
+{
+	auto table = _tables.find(it->table);
+	if (table != _tables.end())
+	{
+		table->second.erase(it->key);
+		if (table->second.empty())
+			_tables.erase(table);
+	}
+	_size -= it->size();
+	_entries.erase(it->key);
+	_lru.erase(it);
+}
+
+std::string ResultCache::tag(const db::Database& db, std::string_view table)
+{
+	std::string tag = db.filename();
+	tag += '|';
+	tag += table;
+	return tag;
+}
+
+void ResultCache::watch(db::Database& db)
+{
+	db.onChange([this, &db](const db::Change& change) { invalidate(tag(db, change.table), change.rowid); });
+}
+
+ResultCache::Hit ResultCache::find(const std::string& key)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto found = _entries.find(key);
+	if (found == _entries.end())
+	{
+		++_misses;
+		return {};
+	}
+	++_hits;
+	_lru.splice(_lru.begin(), _lru, found->second);
+	return { found->second->data, found->second->link };
+}
+
+ResultCache::Generation ResultCache::generation(const std::string& table)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _generations[table];
+}
+
+void ResultCache::insert(std::string key, std::string table, std::optional<sqlite_int64> rowid, Buffer data, std::string link, Generation generation)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_generations[table] != generation)
+		return;
+
+	if (auto found = _entries.find(key); found != _entries.end())
+		_erase(found->second);
+
+	Entry entry{ std::move(key), std::move(table), rowid, std::move(data), std::move(link) };
+	const auto size = entry.size();
+	if (size > _capacity)
+		return;
+	while (_size + size > _capacity)
+		_erase(std::prev(_lru.end()));
+
+	_lru.push_front(std::move(entry));
+	auto& e = _lru.front();
+	_size += size;
+	_entries.emplace(e.key, _lru.begin());
+	_tables[e.table].insert(e.key);
+}
+
+void ResultCache::invalidate(std::string_view table_name, std::optional<sqlite_int64> rowid)
+{
+	const std::string name(table_name);
+	std::lock_guard<std::mutex> lock(_mutex);
+	++_generations[name];
+
+	auto table = _tables.find(name);
+	if (table == _tables.end())
+		return;
+
+	std::vector<List::iterator> stale;
+	for (auto&& key : table->second)
+	{
+		auto it = _entries.at(key);
+		if (!rowid || !it->rowid || *it->rowid == *rowid)
+			stale.push_back(it);
+	}
+	for (auto it : stale)
+		_erase(it);
+	_dropped += stale.size();
+}
+
+ResultCache::Stats ResultCache::stats()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return { _entries.size(), _size, _hits, _misses, _dropped };
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "pointers.h"
+#include "database.h"
+
+// Serialized GET responses, bounded by total size and evicted least recently
+// used first. Entries tied to a single row are dropped when that row changes,
+// all others when anything in their table changes. One cache can serve several
+// databases, so tables go by the tag naming their database too.
+class ResultCache
+{
+public:
+	using Buffer = shared<const std::string>;
+	using Generation = unsigned long long;
+
+	struct Hit
+	{
+		Buffer data;
+		std::string link;
+
+		explicit operator bool() const { return bool(data); }
+	};
+
+	struct Stats
+	{
+		size_t entries;
+		size_t size;
+		size_t hits;
+		size_t misses;
+		size_t dropped;		// Entries invalidated by writes
+	};
+private:
+	struct Entry
+	{
+		std::string key;
+		std::string table;
+		std::optional<sqlite_int64> rowid;
+		Buffer data;
+		std::string link;
+
+		size_t size() const { return sizeof(Entry) + key.size() + table.size() + data->size() + link.size(); }
+	};
+	using List = std::list<Entry>;
+
+	std::mutex _mutex;
+	const size_t _capacity;
+	size_t _size = 0;
+	size_t _hits = 0;
+	size_t _misses = 0;
+	size_t _dropped = 0;
+	List _lru;
+	std::unordered_map<std::string, List::iterator> _entries;
+	std::unordered_map<std::string, std::unordered_set<std::string>> _tables;
+	std::unordered_map<std::string, Generation> _generations;
+
+	void _erase(List::iterator it);
+public:
+	ResultCache(size_t capacity) : _capacity(capacity) { }
+
+	// Names a table of a database apart from those of the same name in others
+	static std::string tag(const db::Database& db, std::string_view table);
+
+	void watch(db::Database& db);
+
+	Hit find(const std::string& key);
+
+	// Take before running the query; insert() ignores results that raced a write.
+	// Tables are given by their tag.
+	Generation generation(const std::string& table);
+	void insert(std::string key, std::string table, std::optional<sqlite_int64> rowid, Buffer data, std::string link, Generation generation);
+
+	void invalidate(std::string_view table, std::optional<sqlite_int64> rowid);
+
+	Stats stats();
+};
@@ -0,0 +1,77 @@
+#include "checkpoint.h"
+
+#include <iostream>
+#include <filesystem>
+
+Checkpointer::Checkpointer(db::Database& db, Settings settings) : 
+	_db(db), _settings(settings), _wal(db.filename() + "-wal"), _last_write(Clock::now().time_since_epoch().count())
+{
+	sqlite3* handle;
+	if (sqlite3_open_v2(db.filename().c_str(), &handle, SQLITE_OPEN_READWRITE, nullptr))
+	{
+		sqlite3_close(handle);
+		throw std::runtime_error("Could not open database for checkpoints");
+	}
+	_handle.reset(handle);
+	// A connection only notices the log once it has read something
+	sqlite3_exec(handle, "PRAGMA schema_version", nullptr, nullptr, nullptr);
+
+	db.pragma("wal_autocheckpoint", "0");
+	_listener = db.onChange([this](const db::Change&) { _last_write = Clock::now().time_since_epoch().count(); });
+
+	_thread = std::thread([this] { _run(); });
+}
+
+Checkpointer::~Checkpointer()
+{
+	_db.removeListener(_listener);
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+	_wake.notify_all();
+	_thread.join();
+}
+
+void Checkpointer::_run()
+{
+	using namespace std::filesystem;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (!_wake.wait_for(lock, _settings.interval, [this] { return _stopping; }))
+	{
+		std::error_code error;
+		const auto size = file_size(_wal, error);
+		if (error || size == 0)
+			continue;
+
+		// A passive checkpoint leaves the file at full size, so remember whether
+		// anything was written since the last one that copied the whole log
+		const auto last_write = _last_write.load();
+		const auto idle = Clock::now() - Clock::time_point(Clock::duration(last_write));
+		if (idle >= _settings.idle)
+			_checkpoint(SQLITE_CHECKPOINT_TRUNCATE);
+		else if (size >= _settings.passive_bytes && last_write != _copied_through)
+		{
+			if (_checkpoint(SQLITE_CHECKPOINT_PASSIVE))
+				_copied_through = last_write;
+		}
+	}
+}
+
+bool Checkpointer::_checkpoint(int mode)
+{
+	int log = 0, copied = 0;
+	const auto start = Clock::now();
+	const int rc = sqlite3_wal_checkpoint_v2(_handle.get(), nullptr, mode, &log, &copied);
+	const auto took = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	if (rc == SQLITE_BUSY)
+		return false;
+	if (rc != SQLITE_OK)
+	{
+		std::cout << "Checkpoint failed: " << sqlite3_errmsg(_handle.get()) << "\n";
+		return false;
+	}
+	std::cout << (mode == SQLITE_CHECKPOINT_TRUNCATE ? "truncating" : "passive") << " checkpoint copied " << copied << " of " << log << " pages in " << took << "ms\n";
+	return copied == log;
+}
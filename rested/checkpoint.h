@@ -0,0 +1,54 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <memory>
+#include <cstdint>
+#include <condition_variable>
+
+#include "database.h"
+
+// Copies the write-ahead log back into the database from a thread of its own,
+// over a connection of its own, so that no request pays for a checkpoint.
+// While writes keep coming it runs passive checkpoints once the log has grown
+// large; after a quiet spell it runs a truncating one to empty the log file.
+class Checkpointer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Settings
+	{
+		std::chrono::milliseconds interval{ 1000 };
+		std::uintmax_t passive_bytes = 4 << 20;
+		std::chrono::milliseconds idle{ 5000 };
+	};
+private:
+	struct Deleter { void operator()(sqlite3* handle) { sqlite3_close(handle); } };
+
+	db::Database& _db;
+	const Settings _settings;
+	const std::string _wal;
+	size_t _listener;
+	std::unique_ptr<sqlite3, Deleter> _handle;
+	std::atomic<Clock::rep> _last_write;
+	Clock::rep _copied_through = 0;
+
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	bool _stopping = false;
+	std::thread _thread;
+
+	void _run();
+	// True when the whole log made it into the database
+	bool _checkpoint(int mode);
+public:
+	// Takes over from SQLite's own checkpoints, which run inside a committing write.
+	// The database must outlive the checkpointer.
+	Checkpointer(db::Database& db, Settings settings);
+	Checkpointer(db::Database& db) : Checkpointer(db, Settings{}) { }
+	~Checkpointer();
+};
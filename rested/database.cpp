@@ -1,10 +1,34 @@
 #include "database.h"
+#include "json.h"
 
 #include <iostream>
 #include <string>
+#include <algorithm>
 
 namespace db
 {
+	Criterium in(std::string key, const std::vector<Value>& values)
+	{
+		std::string list = "[";
+		for (auto&& v : values)
+		{
+			if (list.size() > 1)
+				list.push_back(',');
+			v.visit([&](auto&& x)
+			{
+				using T = std::decay_t<decltype(x)>;
+				if constexpr (std::is_same_v<T, nullptr_t>)
+					list.append("null");
+				else if constexpr (std::is_same_v<T, sqlite_int64>)
+					json::append(list, static_cast<long long>(x));
+				else
+					json::append(list, x);
+			});
+		}
+		list.push_back(']');
+		return { std::move(key), std::move(list), Comparator::In };
+	}
+
 	Database::Handle Database::_open(const char * filename)
 	{
 		sqlite3* handle;
@@ -13,14 +37,136 @@ namespace db
 		return Handle(handle);
 	}
 
+	StorageProfile StorageProfile::named(std::string_view name)
+	{
+		if (name == "durable")
+			return durable();
+		if (name == "balanced")
+			return balanced();
+		if (name == "throughput")
+			return throughput();
+		throw std::invalid_argument("Unknown storage profile: " + std::string(name));
+	}
+
+	std::string Database::pragma(string_view name, string_view value)
+	{
+		std::lock_guard<std::recursive_mutex> lock(_writer);
+		Query q = query("PRAGMA " + string(name) + " = " + string(value));
+		auto row = q.cursor();
+		return row.next() && !row.isNull(0) ? string(row.text(0)) : string();
+	}
+
+	void Database::configure(const StorageProfile& profile)
+	{
+		auto journal = pragma("journal_mode", profile.journal_mode);
+		if (!std::equal(journal.begin(), journal.end(), profile.journal_mode.begin(), profile.journal_mode.end(), 
+			[](char a, char b) { return toupper(a) == toupper(b); }))
+			std::cout << "Journal mode stayed " << journal << " instead of " << profile.journal_mode << "\n";
+		pragma("synchronous", profile.synchronous);
+		pragma("mmap_size", std::to_string(profile.mmap_size));
+		pragma("cache_size", std::to_string(profile.cache_size));
+		pragma("temp_store", profile.temp_store);
+	}
+
+	void Database::_update_hook(void* self, int op, const char*, const char* table, sqlite_int64 rowid)
+	{
+		static_cast<Database*>(self)->_changed(op, table, rowid);
+	}
+
+	int Database::_commit_hook(void* self)
+	{
+		static_cast<Database*>(self)->_deliver();
+		return 0;
+	}
+
+	// Readers on this connection saw the rows while the transaction was open and
+	// may have kept them, so the listeners hear of a rollback as of a commit
+	void Database::_rollback_hook(void* self)
+	{
+		static_cast<Database*>(self)->_deliver();
+	}
+
+	void Database::_changed(int op, string_view table, std::optional<sqlite_int64> rowid)
+	{
+		std::lock_guard<std::mutex> lock(_changes_mutex);
+		_changes.push_back({ op, string(table), rowid });
+	}
+
+	void Database::_deliver()
+	{
+		std::vector<Changed> changes;
+		{
+			std::lock_guard<std::mutex> lock(_changes_mutex);
+			changes.swap(_changes);
+		}
+		for (auto& change : changes)
+			_notify({ change.op, change.table, change.rowid });
+	}
+
+	StatementCache::~StatementCache()
+	{
+		for (auto stmt : _lru)
+			sqlite3_finalize(stmt);
+	}
+
+	sqlite3_stmt* StatementCache::take(const std::string& sql)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto found = _idle.find(sql);
+		if (found == _idle.end())
+			return nullptr;
+		auto stmt = *found->second;
+		_lru.erase(found->second);
+		_idle.erase(found);
+		return stmt;
+	}
+
+	void StatementCache::give(sqlite3_stmt* stmt)
+	{
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_lru.push_front(stmt);
+		_idle.emplace(sqlite3_sql(stmt), _lru.begin());
+		if (_lru.size() <= _capacity)
+			return;
+
+		auto oldest = std::prev(_lru.end());
+		auto range = _idle.equal_range(sqlite3_sql(*oldest));
+		for (auto it = range.first; it != range.second; ++it)
+			if (it->second == oldest)
+			{
+				_idle.erase(it);
+				break;
+			}
+		sqlite3_finalize(*oldest);
+		_lru.erase(oldest);
+	}
+
+	void STMT::Deleter::operator()(sqlite3_stmt* ptr)
+	{
+		if (!ptr)
+			return;
+		if (auto statements = cache.lock())
+			statements->give(ptr);
+		else
+			sqlite3_finalize(ptr);
+	}
+
 	Query Database::query(const std::string & query)
 	{
 		//std::cout << query << "\n";
 
+		if (auto stmt = _statements->take(query))
+			return { STMT(stmt, _statements) };
+
+		// Unlike sqlite3_prepare, this prepares again by itself when the schema
+		// changes, which kept statements would otherwise fail on
 		sqlite3_stmt* stmt;
-		switch (sqlite3_prepare(_handle.get(), query.c_str(), query.size(), &stmt, nullptr))
+		switch (sqlite3_prepare_v2(_handle.get(), query.c_str(), int(query.size()), &stmt, nullptr))
 		{
-		case SQLITE_OK: return { STMT(stmt) };
+		case SQLITE_OK: return { STMT(stmt, _statements) };
 		case SQLITE_ERROR: throw std::runtime_error("Error preparing query: " + _error());
 		default:
 			throw std::runtime_error("Unecpected error code");
@@ -37,9 +183,356 @@ namespace db
 			std::cout << "\n";
 		}
 
+		if (auto advisor = _build->db._advisor.get(); advisor && !_build->keys.empty())
+			advisor->observe(_build->table, _build->keys);
+
 		Query q = _build->db.query(_build->so_far);
 		for (auto&& iv : _build->binds | ranged::enumerate)
-			iv.second.visit([&](auto&& v) { q.bind(iv.first + 1, v); });
+			iv.second.visit([&](auto&& v) 
+			{ 
+				// The builder, which owns the text, is usually gone before the query runs
+				if constexpr (std::is_same_v<std::decay_t<decltype(v)>, std::string>)
+					q.bindCopy(iv.first + 1, v);
+				else
+					q.bind(iv.first + 1, v); 
+			});
 		return q;
 	}
+
+	Database::Page::Page(BuildStep&& step, const Order& order, const std::optional<Keyset>& after, std::optional<sqlite_int64> limit) : 
+		ReadyStep(std::move(step))
+	{
+		const auto column = identifier(order.column);
+		const std::string_view direction = order.descending ? " DESC" : "";
+		const std::string_view beyond = order.descending ? " < ?" : " > ?";
+
+		if (after)
+		{
+			*_build << (_build->keys.empty() ? " WHERE " : " AND ");
+			if (order.column == "id")
+			{
+				*_build << "id" << beyond;
+				_build->binds.push_back(after->id);
+			}
+			else if (std::holds_alternative<nullptr_t>(after->value))
+			{
+				// NULLs sort first, so ascending continues through the remaining NULLs and
+				// then everything else, while descending has only the remaining NULLs left
+				*_build << "((" << column << " IS NULL AND id" << beyond << ")";
+				if (!order.descending)
+					*_build << " OR " << column << " IS NOT NULL";
+				*_build << ")";
+				_build->binds.push_back(after->id);
+			}
+			else
+			{
+				*_build << "((" << column << ", id)" << beyond.substr(0, 3) << "(?, ?)";
+				if (order.descending)
+					*_build << " OR " << column << " IS NULL";
+				*_build << ")";
+				_build->binds.push_back(after->value);
+				_build->binds.push_back(after->id);
+			}
+		}
+
+		*_build << " ORDER BY " << column << direction;
+		if (order.column != "id")
+			*_build << ", id" << direction;
+
+		if (limit)
+		{
+			*_build << " LIMIT ?";
+			_build->binds.push_back(*limit);
+		}
+	}
+
+	std::set<std::string> Database::indexedColumns(std::string_view table)
+	{
+		std::set<std::string> result;
+		Query q = query("SELECT ii.name FROM pragma_index_list(?) il, pragma_index_info(il.name) ii WHERE ii.seqno = 0");
+		q.bind(1, table);
+		for (auto& row : q.cursor())
+			result.emplace(row.text(0));
+		return result;
+	}
+
+	std::vector<std::string> Database::columns(std::string_view table)
+	{
+		std::vector<std::string> result;
+		Query q = query("SELECT name FROM pragma_table_info(?) ORDER BY cid");
+		q.bind(1, table);
+		for (auto& row : q.cursor())
+			result.emplace_back(row.text(0));
+		return result;
+	}
+
+	std::vector<Reference> Database::references(std::string_view table)
+	{
+		std::vector<Reference> result;
+		// Keys over several columns have more than one row with the same id
+		Query q = query("SELECT \"from\", \"table\", \"to\" FROM pragma_foreign_key_list(?) "
+			"WHERE id IN (SELECT id FROM pragma_foreign_key_list(?) GROUP BY id HAVING count(*) = 1)");
+		q.bind(1, table);
+		q.bind(2, table);
+		for (auto& row : q.cursor())
+			result.push_back({ std::string(row.text(0)), std::string(row.text(1)), 
+				row.isNull(2) ? "rowid" : std::string(row.text(2)) });
+		return result;
+	}
+
+	void Database::CreateSearch::exec()
+	{
+		auto transaction = _db.transaction();
+		bool created;
+		{
+			Query exists = _db.query("SELECT count(*) FROM sqlite_master WHERE name = ?");
+			exists.bind(1, _search.name);
+			auto row = exists.cursor();
+			created = row.next() && row.integer(0) == 0;
+		}
+
+		for (auto& sql : _search.sql())
+			_db.query(sql).exec();
+		if (created)
+		{
+			const auto fts = identifier(_search.name);
+			_db.query("INSERT INTO " + fts + " (" + fts + ") VALUES ('rebuild')").exec();
+		}
+		transaction.commit();
+	}
+
+	Query Database::search(string_view table, string_view match, sqlite_int64 limit)
+	{
+		const auto fts = identifier(string(table) + "_search");
+		const auto content = identifier(table);
+		Query q = query("SELECT " + content + ".* FROM " + fts + " JOIN " + content + " ON " + content + ".rowid = " + fts + ".rowid"
+			" WHERE " + fts + " MATCH ? ORDER BY " + fts + ".rank LIMIT ?");
+		q.bindCopy(1, match);
+		q.bind(2, limit);
+		return q;
+	}
+
+	void Database::ReadyStep::exec()
+	{
+		auto q = _prepare();
+		_build->db.exec(q, _build->table, _build->assigned);
+	}
+
+	void Database::exec(Query& q, string_view table, const std::vector<string>& assigned)
+	{
+		exec(q);
+		// The update hook reports an assignment to the rowid under the new id
+		// only, so whatever was cached under the old id must go table-wide
+		for (auto&& column : assigned)
+			if (column == "id" || column == "rowid")
+			{
+				_changed(SQLITE_UPDATE, table, std::nullopt);
+				// Outside a transaction the write has committed already
+				if (sqlite3_get_autocommit(_handle.get()))
+					_deliver();
+				break;
+			}
+	}
+
+	void Database::profile(std::chrono::nanoseconds threshold)
+	{
+		sqlite3_trace_v2(_handle.get(), 0, nullptr, nullptr);
+		_profiler = std::make_unique<Profiler>(filename(), threshold);
+		sqlite3_trace_v2(_handle.get(), SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW, Profiler::trace, _profiler.get());
+	}
+
+	int Profiler::trace(unsigned type, void* self, void* p, void* x)
+	{
+		auto profiler = static_cast<Profiler*>(self);
+		auto stmt = static_cast<sqlite3_stmt*>(p);
+		if (type == SQLITE_TRACE_ROW)
+		{
+			std::lock_guard<std::mutex> lock(profiler->_mutex);
+			++profiler->_rows[stmt];
+		}
+		else if (type == SQLITE_TRACE_PROFILE)
+			profiler->_profile(stmt, Duration(*static_cast<sqlite3_int64*>(x)));
+		return 0;
+	}
+
+	void Profiler::_profile(sqlite3_stmt* stmt, Duration time)
+	{
+		const sqlite_int64 steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+		sqlite_int64 rows = 0;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto counted = _rows.find(stmt);
+			if (counted != _rows.end())
+			{
+				rows = counted->second;
+				_rows.erase(counted);
+			}
+
+			std::string sql = sqlite3_sql(stmt);
+			auto found = _stats.find(sql);
+			if (found == _stats.end() && _stats.size() < max_statements)
+				found = _stats.emplace(std::move(sql), Stats{}).first;
+			if (found != _stats.end())
+			{
+				auto& stats = found->second;
+				++stats.runs;
+				stats.total += time;
+				stats.max = std::max(stats.max, time);
+				stats.rows += rows;
+				stats.steps += steps;
+				if (stats.recent.size() < max_recent)
+					stats.recent.push_back(time);
+				else
+					stats.recent[stats.next] = time;
+				stats.next = (stats.next + 1) % max_recent;
+			}
+		}
+		if (time < _threshold)
+			return;
+
+		Slow slow{ {}, time, rows, steps, _explain(sqlite3_sql(stmt)) };
+		if (auto expanded = sqlite3_expanded_sql(stmt))
+		{
+			slow.sql = expanded;
+			sqlite3_free(expanded);
+		}
+		else
+			slow.sql = sqlite3_sql(stmt);
+
+		std::cout << "Slow query (" << std::chrono::duration<double, std::milli>(time).count() << "ms, " 
+			<< rows << " rows, " << steps << " steps): " << slow.sql << "\n";
+		for (auto& line : slow.plan)
+			std::cout << "  " << line << "\n";
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_slow.push_back(std::move(slow));
+		if (_slow.size() > max_slow)
+			_slow.pop_front();
+	}
+
+	std::vector<std::string> Profiler::_explain(const char* sql)
+	{
+		std::vector<std::string> plan;
+		std::lock_guard<std::mutex> lock(_explain_mutex);
+		if (!_explainer)
+		{
+			sqlite3* handle = nullptr;
+			if (_filename.empty() || sqlite3_open_v2(_filename.c_str(), &handle, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+			{
+				sqlite3_close(handle);
+				return plan;
+			}
+			_explainer.reset(handle);
+		}
+
+		sqlite3_stmt* stmt;
+		const std::string explain = std::string("EXPLAIN QUERY PLAN ") + sql;
+		if (sqlite3_prepare_v2(_explainer.get(), explain.c_str(), int(explain.size()), &stmt, nullptr) != SQLITE_OK)
+			return plan;
+		try
+		{
+			Cursor row(stmt);
+			while (row.next())
+				plan.emplace_back(row.text(3));
+		}
+		catch (std::exception& e) { plan.emplace_back(e.what()); }
+		sqlite3_finalize(stmt);
+		return plan;
+	}
+
+	std::vector<Profiler::Statement> Profiler::top(size_t count, Rank rank)
+	{
+		std::vector<Statement> result;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (auto& kv : _stats)
+			{
+				auto recent = kv.second.recent;
+				const size_t at = (recent.size() * 99 + 99) / 100 - 1;
+				std::nth_element(recent.begin(), recent.begin() + at, recent.end());
+				auto& s = kv.second;
+				result.push_back({ kv.first, s.runs, s.total, recent[at], s.max, s.rows, s.steps });
+			}
+		}
+		auto key = [rank](const Statement& s) { return rank == Rank::Total ? s.total : s.p99; };
+		count = std::min(count, result.size());
+		std::partial_sort(result.begin(), result.begin() + count, result.end(), 
+			[&](const Statement& a, const Statement& b) { return key(a) > key(b); });
+		result.resize(count);
+		return result;
+	}
+
+	void IndexAdvisor::observe(std::string_view table, Keys keys)
+	{
+		// An index never helps with !=, and columns compared for equality go before
+		// the one a range is taken on
+		keys.erase(std::remove_if(keys.begin(), keys.end(), [](auto& k) { return k.second == Comparator::NotEqual; }), keys.end());
+		auto ranged = [](Comparator cmp)
+		{
+			return cmp == Comparator::Less || cmp == Comparator::LessEqual || cmp == Comparator::Greater ||
+				cmp == Comparator::GreaterEqual || cmp == Comparator::Between || cmp == Comparator::NotNull;
+		};
+		std::sort(keys.begin(), keys.end(), [&](auto& a, auto& b) 
+		{
+			return std::make_tuple(ranged(a.second), a.first, a.second) < std::make_tuple(ranged(b.second), b.first, b.second);
+		});
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+		if (keys.empty())
+			return;
+
+		std::string signature(table);
+		for (auto&& k : keys)
+			signature.append(" ").append(k.first).append(orth(k.second));
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_seen.insert(std::move(signature)).second)
+			_pending.emplace_back(std::string(table), std::move(keys));
+	}
+
+	std::vector<IndexDefinition> IndexAdvisor::review(Database& db)
+	{
+		decltype(_pending) pending;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			pending.swap(_pending);
+		}
+
+		std::vector<IndexDefinition> found;
+		for (auto& [table, keys] : pending)
+		{
+			// Probes with the comparisons actually made, as SQLite picks indexes by them
+			std::string plan = "EXPLAIN QUERY PLAN SELECT * FROM ";
+			plan.append(identifier(table));
+			std::string_view keyword = " WHERE ";
+			std::vector<std::string> columns;
+			for (auto&& k : keys)
+			{
+				plan.append(keyword).append(identifier(k.first)).append(orth(k.second));
+				keyword = " AND ";
+				if (std::find(columns.begin(), columns.end(), k.first) == columns.end())
+					columns.push_back(k.first);
+			}
+
+			bool scans = false;
+			Query explain = db.query(plan);
+			for (auto& row : explain.cursor())
+				if (row.text(3).substr(0, 4) == "SCAN")
+					scans = true;
+			if (!scans)
+				continue;
+
+			auto missing = index(table, columns);
+			std::cout << "index advisor: no index serves " << plan.substr(19) << ", suggest: " << missing.sql() << "\n";
+			if (_create)
+			{
+				Query create = db.query(missing.sql());
+				db.exec(create);
+			}
+			found.push_back(std::move(missing));
+		}
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_missing.insert(_missing.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+		return _missing;
+	}
 }
@@ -1,11 +1,25 @@
 #pragma once
 
 #include <tuple>
+#include <array>
+#include <utility>
+#include <type_traits>
 #include <stdexcept>
 #include <memory>
 #include <vector>
 #include <string>
 #include <variant>
+#include <mutex>
+#include <set>
+#include <list>
+#include <deque>
+#include <chrono>
+#include <unordered_map>
+#include <optional>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <iostream>
 #include <sqlite3.h>
 
 #include "pointers.h"
@@ -14,31 +28,76 @@
 
 #include "view.h"
 
+class Snapshot;
+class Backup;
+
 namespace db
 {
 	class Database;
 
+	// Prepared statements of one connection that are not in use, kept by their
+	// SQL so that running the same text again skips preparing it. The least
+	// recently used go once there are more than the capacity.
+	class StatementCache
+	{
+		using List = std::list<sqlite3_stmt*>;
+
+		std::mutex _mutex;
+		const size_t _capacity;
+		List _lru;
+		std::unordered_multimap<std::string, List::iterator> _idle;
+	public:
+		StatementCache(size_t capacity) : _capacity(capacity) { }
+		StatementCache(const StatementCache&) = delete;
+		~StatementCache();
+
+		// A statement for the SQL, reset and without bindings, or null
+		sqlite3_stmt* take(const std::string& sql);
+		// Keeps the statement for the next take, finalizing the oldest if full
+		void give(sqlite3_stmt* stmt);
+	};
+
 	class STMT
 	{
-		struct Deleter { void operator()(sqlite3_stmt* ptr) { sqlite3_finalize(ptr); } };
+		// Hands the statement back to its cache, unless that has been closed
+		struct Deleter 
+		{ 
+			std::weak_ptr<StatementCache> cache;
+			void operator()(sqlite3_stmt* ptr);
+		};
 		using Handle = shared<sqlite3_stmt>;
 
 		Handle _handle;
 	public:
 		STMT() = default;
-		STMT(sqlite3_stmt* stmt) : _handle(stmt, Deleter{}) { }
+		STMT(sqlite3_stmt* stmt, std::weak_ptr<StatementCache> cache = {}) : _handle(stmt, Deleter{ std::move(cache) }) { }
 
 		sqlite3_stmt* get() const { return _handle.get(); }
 	};
 
 	struct End { };
 
-	enum class Comparator : char { Equal };
+	enum class Comparator : char 
+	{ 
+		Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual, 
+		In, IsNull, NotNull, Between 
+	};
+	// The comparison following the column name, with placeholders for its bound values
 	inline std::string_view orth(Comparator cmp)
 	{
 		switch (cmp)
 		{
-		case Comparator::Equal: return " = ";
+		case Comparator::Equal:        return " = ?";
+		case Comparator::NotEqual:     return " != ?";
+		case Comparator::Less:         return " < ?";
+		case Comparator::LessEqual:    return " <= ?";
+		case Comparator::Greater:      return " > ?";
+		case Comparator::GreaterEqual: return " >= ?";
+		// The whole list is bound as one JSON array, so one statement serves every list length
+		case Comparator::In:           return " IN (SELECT value FROM json_each(?))";
+		case Comparator::IsNull:       return " IS NULL";
+		case Comparator::NotNull:      return " IS NOT NULL";
+		case Comparator::Between:      return " BETWEEN ? AND ?";
 		default: throw std::logic_error("Invalid comparator value");
 		}
 	}
@@ -58,6 +117,18 @@ namespace db
 		return result;
 	}
 
+	inline std::string identifier(std::string_view name)
+	{
+		std::string result;
+		result.reserve(name.size() + 2);
+		result.push_back('"');
+		for (auto ch : name)
+			if (ch == '"') result.append("\"\"");
+			else           result.push_back(ch);
+		result.push_back('"');
+		return result;
+	}
+
 	using ValueVariant = std::variant<nullptr_t, sqlite_int64, double, std::string>;
 	class Value : public ValueVariant
 	{
@@ -88,10 +159,101 @@ namespace db
 		std::string key;
 		Value value;
 		Comparator cmp;
+		Value upper = nullptr; // Upper bound for Between
+
+		template <class F>
+		void visitBinds(F&& f) const
+		{
+			switch (cmp)
+			{
+			case Comparator::IsNull: case Comparator::NotNull: return;
+			case Comparator::Between: f(value); f(upper); return;
+			default: f(value); return;
+			}
+		}
 	};
 
 	inline Criterium equal(std::string key, Value value) { return { std::move(key), std::move(value), Comparator::Equal }; }
+	inline Criterium compare(std::string key, Comparator cmp, Value value) { return { std::move(key), std::move(value), cmp }; }
+	inline Criterium between(std::string key, Value lower, Value upper) { return { std::move(key), std::move(lower), Comparator::Between, std::move(upper) }; }
+	inline Criterium isNull(std::string key)  { return { std::move(key), nullptr, Comparator::IsNull }; }
+	inline Criterium notNull(std::string key) { return { std::move(key), nullptr, Comparator::NotNull }; }
+	Criterium in(std::string key, const std::vector<Value>& values);
+
+	using ValueView = std::variant<nullptr_t, sqlite_int64, double, std::string_view>;
+
+	// Non-owning view of the current row of a statement. Text views and the
+	// row itself are only valid until the next step, and the owning Query
+	// must outlive the cursor.
+	class Cursor
+	{
+		sqlite3_stmt* _stmt;
+		int _rc = SQLITE_ROW;
 
+		class Iterator
+		{
+			Cursor* _cursor;
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using difference_type = std::ptrdiff_t;
+			using value_type = Cursor;
+			using reference = const value_type&;
+			using pointer = const value_type*;
+
+			Iterator(Cursor* cursor) : _cursor(cursor) { }
+
+			Iterator& operator++() { _cursor->next(); return *this; }
+
+			reference operator*() const { return *_cursor; }
+			pointer operator->() const { return _cursor; }
+
+			bool operator!=(End) const { return _cursor->_rc == SQLITE_ROW; }
+		};
+	public:
+		Cursor(sqlite3_stmt* stmt) : _stmt(stmt) { sqlite3_reset(_stmt); }
+
+		bool next()
+		{
+			_rc = sqlite3_step(_stmt);
+			if (_rc != SQLITE_ROW && _rc != SQLITE_DONE)
+				throw std::runtime_error(std::string("Error stepping query: ") + sqlite3_errmsg(sqlite3_db_handle(_stmt)));
+			return _rc == SQLITE_ROW;
+		}
+
+		Iterator begin() { next(); return this; }
+		End      end()   { return {}; }
+
+		int size() const { return sqlite3_column_count(_stmt); }
+
+		std::string_view name(int i) const { return sqlite3_column_name(_stmt, i); }
+		int              type(int i) const { return sqlite3_column_type(_stmt, i); }
+		bool           isNull(int i) const { return type(i) == SQLITE_NULL; }
+
+		sqlite_int64 integer(int i) const { return sqlite3_column_int64(_stmt, i); }
+		double          real(int i) const { return sqlite3_column_double(_stmt, i); }
+		std::string_view text(int i) const
+		{
+			auto data = reinterpret_cast<const char*>(sqlite3_column_text(_stmt, i));
+			return { data ? data : "", size_t(sqlite3_column_bytes(_stmt, i)) };
+		}
+
+		ValueView value(int i) const
+		{
+			switch (type(i))
+			{
+			case SQLITE_NULL: return nullptr;
+			case SQLITE_INTEGER: return integer(i);
+			case SQLITE_FLOAT: return real(i);
+			case SQLITE_TEXT: return text(i);
+			default:
+				throw std::logic_error("Unknown column type encountered");
+			}
+		}
+	};
+
+
+	template <class T>
+	class Rows;
 
 	class Query
 	{
@@ -194,10 +356,22 @@ namespace db
 
 		std::string sql() const { return _row.sql(); }
 
+		sqlite3_stmt* get() const { return _row._do([](sqlite3_stmt* stmt) { return stmt; }); }
+
+		Cursor cursor() const { return { get() }; }
+
+		// The rows as T, which lists its columns in a static fields() function
+		template <class T>
+		Rows<T> as() const;
+
 		void bind(int pos, nullptr_t)              { _row.reset(); _row._do(sqlite3_bind_null, pos); }
 		void bind(int pos, double value)           { _row.reset(); _row._do(sqlite3_bind_double, pos, value); }
 		void bind(int pos, sqlite_int64 value)     { _row.reset(); _row._do(sqlite3_bind_int64, pos, value); }
 		void bind(int pos, std::string_view value) { _row.reset(); _row._do(sqlite3_bind_text, pos, value.data(), value.size(), SQLITE_STATIC); }
+		void bind(int pos, const std::string& value) { bind(pos, std::string_view{ value }); }
+		void bind(int pos, const ValueView& value) { std::visit([&](auto v) { bind(pos, v); }, value); }
+		// For text that will not outlive the query
+		void bindCopy(int pos, std::string_view value) { _row.reset(); _row._do(sqlite3_bind_text, pos, value.data(), value.size(), SQLITE_TRANSIENT); }
 
 		Query operator()(sqlite_int64 value) { bind(1, value); return *this; }
 
@@ -212,6 +386,161 @@ namespace db
 		}
 	};
 
+	// A member of T filled from the result column of the same name by Query::as,
+	// and written under that name by json::Writer
+	template <class T, class M>
+	struct Field
+	{
+		std::string_view name;
+		M T::* member;
+		std::string_view key;			// The name as a quoted JSON key with its colon, when spelled out
+	};
+	template <class T, class M>
+	constexpr Field<T, M> field(std::string_view name, M T::* member, std::string_view key = {}) { return { name, member, key }; }
+
+// The field named after member, with its JSON key spelled out at compile time
+#define DB_FIELD(T, member) db::field(#member, &T::member, "\"" #member "\": ")
+
+	namespace mapping
+	{
+		inline void read(sqlite3_stmt* stmt, int i, sqlite_int64& out) { out = sqlite3_column_int64(stmt, i); }
+		inline void read(sqlite3_stmt* stmt, int i, int& out)          { out = sqlite3_column_int(stmt, i); }
+		inline void read(sqlite3_stmt* stmt, int i, bool& out)         { out = sqlite3_column_int(stmt, i) != 0; }
+		inline void read(sqlite3_stmt* stmt, int i, double& out)       { out = sqlite3_column_double(stmt, i); }
+		inline void read(sqlite3_stmt* stmt, int i, std::string& out)
+		{
+			auto data = reinterpret_cast<const char*>(sqlite3_column_text(stmt, i));
+			out.assign(data ? data : "", size_t(sqlite3_column_bytes(stmt, i)));
+		}
+		template <class M>
+		void read(sqlite3_stmt* stmt, int i, std::optional<M>& out)
+		{
+			if (sqlite3_column_type(stmt, i) == SQLITE_NULL)
+				out.reset();
+			else
+				read(stmt, i, out.emplace());
+		}
+
+		template <class M> struct Optional : std::false_type { };
+		template <class M> struct Optional<std::optional<M>> : std::true_type { using type = M; };
+		template <class M> struct Stored { using type = M; };
+		template <class M> struct Stored<std::optional<M>> { using type = M; };
+
+		// Whether a column declared as type can be read into M without surprises
+		template <class M>
+		bool accepts(const char* declared)
+		{
+			if (!declared)
+				return true; // An expression, which has no declared type
+			std::string type = declared;
+			for (auto& ch : type)
+				ch = char(toupper(ch));
+			auto has = [&](const char* part) { return type.find(part) != std::string::npos; };
+			using S = typename Stored<M>::type;
+			if constexpr (std::is_same_v<S, std::string>)
+				return has("CHAR") || has("CLOB") || has("TEXT");
+			else if constexpr (std::is_floating_point_v<S>)
+				return has("REAL") || has("FLOA") || has("DOUB") || has("INT");
+			else
+				return has("INT");
+		}
+	}
+
+	// Reads each row of a query into a T. Columns are looked up by name and
+	// checked against the member types once, when the rows are created, so that
+	// each row is only direct sqlite3_column_* calls.
+	template <class T>
+	class Rows
+	{
+		using Fields = decltype(T::fields());
+		static constexpr size_t _count = std::tuple_size_v<Fields>;
+
+		Query _query;
+		Cursor _cursor;
+		std::array<int, _count> _columns;
+		T _current;
+
+		template <size_t... I>
+		void _resolve(const Fields& fields, std::index_sequence<I...>) { (_resolve(std::get<I>(fields), _columns[I]), ...); }
+		template <class M>
+		void _resolve(const Field<T, M>& field, int& column)
+		{
+			auto stmt = _query.get();
+			column = -1;
+			for (int i = 0, n = sqlite3_column_count(stmt); i < n; ++i)
+				if (field.name == sqlite3_column_name(stmt, i))
+					column = i;
+			if (column < 0)
+			{
+				if (mapping::Optional<M>::value)
+					return;
+				throw std::logic_error("The query has no column " + std::string(field.name));
+			}
+			if (!mapping::accepts<M>(sqlite3_column_decltype(stmt, column)))
+				throw std::logic_error("Column " + std::string(field.name) + " is declared " + sqlite3_column_decltype(stmt, column) + ", which its member cannot hold");
+		}
+
+		template <size_t... I>
+		void _read(T& row, const Fields& fields, std::index_sequence<I...>) const { (_read(row, std::get<I>(fields), _columns[I]), ...); }
+		template <class M>
+		void _read(T& row, const Field<T, M>& field, int column) const
+		{
+			if (column >= 0)
+				mapping::read(_query.get(), column, row.*field.member);
+		}
+	public:
+		class Iterator
+		{
+			Rows* _rows;
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using difference_type = std::ptrdiff_t;
+			using value_type = T;
+			using reference = const T&;
+			using pointer = const T*;
+
+			Iterator(Rows* rows) : _rows(rows) { }
+
+			Iterator& operator++() { _rows->_advance(); return *this; }
+
+			reference operator*() const { return _rows->_current; }
+			pointer operator->() const { return &_rows->_current; }
+
+			bool operator!=(End) const { return _rows->_more; }
+		};
+
+		explicit Rows(Query query) : _query(std::move(query)), _cursor(_query.cursor())
+		{
+			_resolve(T::fields(), std::make_index_sequence<_count>{});
+		}
+
+		// Reads the next row into row, leaving it untouched at the end
+		bool next(T& row)
+		{
+			if (!_cursor.next())
+				return false;
+			_read(row, T::fields(), std::make_index_sequence<_count>{});
+			return true;
+		}
+
+		Iterator begin() { _advance(); return this; }
+		End      end()   { return {}; }
+
+		std::vector<T> all()
+		{
+			std::vector<T> result;
+			for (T row; next(row); row = T{})
+				result.push_back(std::move(row));
+			return result;
+		}
+	private:
+		bool _more = true;
+		void _advance() { _more = next(_current); }
+	};
+
+	template <class T>
+	Rows<T> Query::as() const { return Rows<T>(*this); }
+
 	struct ColumnDefinition
 	{
 		std::string so_far;
@@ -264,12 +593,286 @@ namespace db
 	};
 	inline ForeignKey foreignKey(std::initializer_list<std::string_view> column) { return { column }; }
 
+	struct IndexDefinition
+	{
+		std::string name;
+		std::string table;
+		std::vector<std::string> columns;
+		std::string condition;
+		bool is_unique = false;
+
+		IndexDefinition&& unique() && { is_unique = true; return std::move(*this); }
+		// Trailing columns that are not searched on but let the index cover the query.
+		// They go into the name as well, as IF NOT EXISTS only compares names.
+		IndexDefinition&& covering(std::initializer_list<std::string_view> extra) &&
+		{
+			name.append("_with");
+			for (auto&& c : extra)
+				name.append("_").append(c);
+			columns.insert(columns.end(), extra.begin(), extra.end());
+			return std::move(*this);
+		}
+		// Makes this a partial index; the condition is raw SQL over the table's columns.
+		// The name gets a hash of it, which has to stay the same from build to build.
+		IndexDefinition&& where(std::string_view sql) &&
+		{
+			static const char digits[] = "0123456789abcdef";
+			std::uint32_t hash = 2166136261u;
+			for (unsigned char c : sql)
+				hash = (hash ^ c) * 16777619u;
+			name.append("_where_");
+			for (int shift = 28; shift >= 0; shift -= 4)
+				name.push_back(digits[(hash >> shift) & 0xf]);
+			condition = sql;
+			return std::move(*this);
+		}
+
+		std::string sql() const
+		{
+			static const std::string_view comma = ", ";
+			std::string_view delim = "";
+			std::string result = is_unique ? "CREATE UNIQUE INDEX IF NOT EXISTS " : "CREATE INDEX IF NOT EXISTS ";
+			result.append(identifier(name)).append(" ON ").append(identifier(table)).append(" (");
+			for (auto&& c : columns)
+			{
+				result.append(delim).append(identifier(c));
+				delim = comma;
+			}
+			result.append(")");
+			if (!condition.empty())
+				result.append(" WHERE ").append(condition);
+			return result;
+		}
+	};
+	template <class C>
+	IndexDefinition index(std::string_view table, const C& columns)
+	{
+		IndexDefinition result{ std::string(table), std::string(table), {}, {}, false };
+		for (auto&& c : columns)
+		{
+			result.name.append("_").append(c);
+			result.columns.emplace_back(c);
+		}
+		return result;
+	}
+	inline IndexDefinition index(std::string_view table, std::initializer_list<std::string_view> columns) { return index<>(table, columns); }
+
+	// An FTS5 index over text columns of a table, kept up to date by triggers
+	struct SearchDefinition
+	{
+		std::string name;
+		std::string table;
+		std::vector<std::string> columns;
+
+		// The virtual table first, then its triggers
+		std::vector<std::string> sql() const
+		{
+			using namespace ranged;
+			auto list = [&](std::string_view prefix)
+			{
+				std::string result;
+				for (auto&& cd : columns | delimit(", "))
+					result.append(cd.second).append(prefix).append(identifier(cd.first));
+				return result;
+			};
+			const auto fts = identifier(name);
+			const auto insert = "INSERT INTO " + fts + " (rowid, " + list("") + ") VALUES (new.rowid, " + list("new.") + ");";
+			const auto remove = "INSERT INTO " + fts + " (" + fts + ", rowid, " + list("") + ") VALUES ('delete', old.rowid, " + list("old.") + ");";
+			auto trigger = [&](std::string_view event, const std::string& body)
+			{
+				return "CREATE TRIGGER IF NOT EXISTS " + identifier(name + "_" + std::string(event)) +
+					" AFTER " + std::string(event) + " ON " + identifier(table) + " BEGIN " + body + " END";
+			};
+			return 
+			{
+				"CREATE VIRTUAL TABLE IF NOT EXISTS " + fts + " USING fts5(" + list("") + 
+					", content=" + identifier(table) + ", tokenize='unicode61 remove_diacritics 2', prefix='2 3')",
+				trigger("INSERT", insert),
+				trigger("DELETE", remove),
+				trigger("UPDATE", remove + " " + insert),
+			};
+		}
+	};
+	inline SearchDefinition search(std::string_view table, std::initializer_list<std::string_view> columns)
+	{
+		return { std::string(table) + "_search", std::string(table), { columns.begin(), columns.end() } };
+	}
+
+	// Records which column sets are filtered on at runtime and reports the
+	// ones no index serves, optionally creating the missing index.
+	// Recording is all a query pays for; the plans are checked by review().
+	class IndexAdvisor
+	{
+		using Keys = std::vector<std::pair<std::string, Comparator>>;
+
+		std::mutex _mutex;
+		std::set<std::string> _seen;
+		std::vector<std::pair<std::string, Keys>> _pending;
+		std::vector<IndexDefinition> _missing;
+		bool _create;
+	public:
+		IndexAdvisor(bool create) : _create(create) { }
+
+		// Keys are the filtered columns with how they are compared, which decides
+		// whether and in which order an index can serve them
+		void observe(std::string_view table, Keys keys);
+		// Asks SQLite for the plan of each column set observed since the last
+		// review, creating the index it lacks if asked to. Returns all found missing.
+		std::vector<IndexDefinition> review(Database& db);
+
+		std::vector<IndexDefinition> missing() { std::lock_guard<std::mutex> lock(_mutex); return _missing; }
+	};
+
+	// Times every statement run on a connection through sqlite3_trace_v2, and
+	// logs the ones slower than a threshold with their bound values and plan.
+	class Profiler
+	{
+	public:
+		using Duration = std::chrono::nanoseconds;
+
+		struct Statement
+		{
+			std::string sql;
+			size_t runs;
+			Duration total;
+			Duration p99;		// Over the most recent runs
+			Duration max;
+			sqlite_int64 rows;
+			sqlite_int64 steps;
+		};
+		struct Slow
+		{
+			std::string sql;	// With the values that were bound
+			Duration time;
+			sqlite_int64 rows;
+			sqlite_int64 steps;
+			std::vector<std::string> plan;
+		};
+		enum class Rank { Total, P99 };
+	private:
+		struct Stats
+		{
+			size_t runs = 0;
+			Duration total{};
+			Duration max{};
+			sqlite_int64 rows = 0;
+			sqlite_int64 steps = 0;
+			std::vector<Duration> recent;
+			size_t next = 0;
+		};
+		static constexpr size_t max_recent = 512;
+		static constexpr size_t max_slow = 64;
+		static constexpr size_t max_statements = 4096;
+
+		struct Deleter { void operator()(sqlite3* handle) { sqlite3_close(handle); } };
+
+		const Duration _threshold;
+		const std::string _filename;
+
+		std::mutex _mutex;
+		std::unordered_map<std::string, Stats> _stats;
+		std::unordered_map<sqlite3_stmt*, sqlite_int64> _rows;
+		std::deque<Slow> _slow;
+
+		// Plans come from a connection of their own, as the traced one is busy stepping
+		std::mutex _explain_mutex;
+		std::unique_ptr<sqlite3, Deleter> _explainer;
+		std::vector<std::string> _explain(const char* sql);
+
+		void _profile(sqlite3_stmt* stmt, Duration time);
+	public:
+		Profiler(std::string filename, Duration threshold) : _threshold(threshold), _filename(std::move(filename)) { }
+
+		static int trace(unsigned type, void* self, void* p, void* x);
+
+		std::vector<Statement> top(size_t count, Rank rank);
+		std::vector<Slow> slow() { std::lock_guard<std::mutex> lock(_mutex); return { _slow.begin(), _slow.end() }; }
+	};
+
+	// A single column foreign key: column refers to the row of table whose to matches it
+	struct Reference
+	{
+		std::string column;
+		std::string table;
+		std::string to;
+	};
+
+	struct Order
+	{
+		std::string column = "id";
+		bool descending = false;
+	};
+	// Where the previous page ended: the id of its last row and that row's order column value
+	struct Keyset
+	{
+		Value value;
+		sqlite_int64 id;
+	};
+
+	// A row (or, without rowid, an unknown set of rows) of a table was written
+	struct Change
+	{
+		int op;
+		std::string_view table;
+		std::optional<sqlite_int64> rowid;
+	};
+
+	// Settings applied together by Database::configure
+	struct StorageProfile
+	{
+		std::string journal_mode;
+		std::string synchronous;
+		sqlite_int64 mmap_size;
+		sqlite_int64 cache_size;		// Pages, or KiB when negative
+		std::string temp_store;
+
+		// Survives power loss with every commit
+		static StorageProfile durable()    { return { "WAL", "FULL", 0, -2000, "DEFAULT" }; }
+		// May lose the last commits on power loss, but never corrupts
+		static StorageProfile balanced()   { return { "WAL", "NORMAL", 256ll << 20, -16384, "MEMORY" }; }
+		// Leaves flushing to the operating system entirely
+		static StorageProfile throughput() { return { "WAL", "OFF", 1ll << 30, -65536, "MEMORY" }; }
+
+		static StorageProfile named(std::string_view name);
+	};
+
 	class Database
 	{
 		struct Deleter { void operator()(sqlite3* handle) { sqlite3_close(handle); } };
 		using Handle = std::unique_ptr<sqlite3, Deleter>;
 		static Handle _open(const char* filename);
+		// Outlives the handle, which may still report statements while closing
+		std::unique_ptr<Profiler> _profiler;
 		Handle _handle;
+		// Closed before the handle
+		shared<StatementCache> _statements = std::make_shared<StatementCache>(128);
+		std::unique_ptr<IndexAdvisor> _advisor;
+		std::mutex _listeners_mutex;
+		std::vector<std::pair<size_t, std::function<void(const Change&)>>> _listeners;
+		size_t _next_listener = 0;
+		std::recursive_mutex _writer;
+
+		// Changes of the open transaction, told to the listeners once it ends
+		struct Changed
+		{
+			int op;
+			std::string table;
+			std::optional<sqlite_int64> rowid;
+		};
+		std::mutex _changes_mutex;
+		std::vector<Changed> _changes;
+
+		static void _update_hook(void* self, int op, const char*, const char* table, sqlite_int64 rowid);
+		static int _commit_hook(void* self);
+		static void _rollback_hook(void* self);
+		void _changed(int op, std::string_view table, std::optional<sqlite_int64> rowid);
+		void _deliver();
+		void _notify(const Change& change) 
+		{ 
+			std::lock_guard<std::mutex> lock(_listeners_mutex);
+			for (auto&& l : _listeners) 
+				l.second(change); 
+		}
 		std::string _error()
 		{
 			return sqlite3_errmsg(_handle.get());
@@ -282,6 +885,9 @@ namespace db
 			Database& db;
 			string so_far;
 			std::vector<Value> binds;
+			string table;
+			std::vector<std::pair<string, Comparator>> keys;
+			std::vector<string> assigned;
 
 			Builder(Database& db) : db(db) { }
 
@@ -305,11 +911,17 @@ namespace db
 			Query::Iterator begin() { return _prepare().begin(); }
 			End end() { return {}; }
 
-			void exec() { _prepare().exec(); }
+			void exec();
 
 			operator Query() { return _prepare(); }
 		};
 
+		class Page : public ReadyStep
+		{
+		public:
+			Page(BuildStep&& step, const Order& order, const std::optional<Keyset>& after, std::optional<sqlite_int64> limit);
+		};
+
 		class Where : public ReadyStep
 		{
 		public:
@@ -320,17 +932,40 @@ namespace db
 				std::string_view keyword = " WHERE ";
 				for (const Criterium& c : criteria)
 				{
-					*_build << keyword << c.key << orth(c.cmp) << "?";
-					_build->binds.push_back(c.value);
+					*_build << keyword << identifier(c.key) << orth(c.cmp);
+					c.visitBinds([this](const Value& v) { _build->binds.push_back(v); });
+					_build->keys.emplace_back(c.key, c.cmp);
 					keyword = AND;
 				}
 			}
+
+			Page page(const Order& order, const std::optional<Keyset>& after, std::optional<sqlite_int64> limit) &&
+			{
+				return { std::move(*this), order, after, limit };
+			}
 		};
 
 		class From : public ReadyStep
 		{
 		public:
-			From(BuildStep&& build, string_view table) : ReadyStep(std::move(build)) { *_build << " FROM " << table; }
+			From(BuildStep&& build, string_view table) : ReadyStep(std::move(build)) 
+			{ 
+				*_build << " FROM " << table; 
+				_build->table = table;
+			}
+
+			// Adds the given columns of the referenced row, named "<column>.<name>" so
+			// that they never clash with those of the table itself; NULL when it is missing
+			From& leftJoin(const Reference& ref, const std::vector<std::string>& columns)
+			{
+				using namespace ranged;
+				*_build << " LEFT JOIN (SELECT ";
+				for (auto&& cd : columns | delimit(", "))
+					*_build << cd.second << identifier(cd.first) << " AS " << identifier(ref.column + "." + cd.first);
+				*_build << " FROM " << identifier(ref.table) << ") ON " 
+					<< identifier(ref.column + "." + ref.to) << " = " << identifier(ref.column);
+				return *this;
+			}
 
 			template <class C>
 			Where where(const C& criteria) && { return { std::move(*this), criteria }; }
@@ -363,8 +998,9 @@ namespace db
 				{
 					if (c.cmp != Comparator::Equal)
 						throw std::logic_error("Invalid assignment operator");
-					*_build << keyword << c.key << " = ?";
+					*_build << keyword << identifier(c.key) << " = ?";
 					_build->binds.push_back(c.value);
+					_build->assigned.push_back(c.key);
 					keyword = COMMA;
 				}
 			}
@@ -376,13 +1012,43 @@ namespace db
 		class Update : public BuildStep
 		{
 		public:
-			Update(Database& db, string_view table) : BuildStep(db) { *_build << "UPDATE " << table; }
+			Update(Database& db, string_view table) : BuildStep(db) 
+			{ 
+				*_build << "UPDATE " << table; 
+				_build->table = table;
+			}
 
 			template <class C>
 			Set set(const C& criteria) && { return { std::move(*this), criteria }; }
 			Set set(const std::initializer_list<Criterium>& criteria) && { return { std::move(*this), criteria }; }
 		};
 
+		class Insert : public ReadyStep
+		{
+		public:
+			template <class C>
+			Insert(Database& db, string_view table, const C& columns) : ReadyStep(db)
+			{
+				static const std::string_view comma = ", ";
+				std::string_view delim = "";
+				*_build << "INSERT INTO " << identifier(table) << " (";
+				for (auto&& c : columns)
+				{
+					*_build << delim << identifier(c);
+					delim = comma;
+				}
+				*_build << ") VALUES (";
+				delim = "";
+				for (size_t i = 0; i < std::size(columns); ++i)
+				{
+					*_build << delim << "?";
+					delim = comma;
+				}
+				*_build << ")";
+				_build->table = table;
+			}
+		};
+
 		class Create : public ReadyStep
 		{
 		public: 
@@ -405,11 +1071,41 @@ namespace db
 				*_build << ")";
 			}
 		};
+		class CreateIndex : public ReadyStep
+		{
+		public:
+			CreateIndex(Database& db, const IndexDefinition& index) : ReadyStep(db) { *_build << index.sql(); }
+		};
 
+		friend class IndexAdvisor;
+		friend class ::Snapshot;
+		friend class ::Backup;
 		Query query(const string& query);
 	public:
 
-		Database(const std::string& filename) : _handle(_open(filename.c_str())) { }
+		Database(const std::string& filename) : _handle(_open(filename.c_str())) 
+		{ 
+			sqlite3_update_hook(_handle.get(), _update_hook, this);
+			sqlite3_commit_hook(_handle.get(), _commit_hook, this);
+			sqlite3_rollback_hook(_handle.get(), _rollback_hook, this);
+		}
+
+		// Listeners are told of the rows a transaction wrote once it commits or
+		// rolls back, on the writing thread from inside the commit or rollback;
+		// they must not use this connection. Returns the number to remove the
+		// listener by.
+		size_t onChange(std::function<void(const Change&)> listener) 
+		{ 
+			std::lock_guard<std::mutex> lock(_listeners_mutex);
+			_listeners.emplace_back(_next_listener, std::move(listener)); 
+			return _next_listener++;
+		}
+		// Waits for the listeners being called, so this one is not running once this returns
+		void removeListener(size_t listener)
+		{
+			std::lock_guard<std::mutex> lock(_listeners_mutex);
+			_listeners.erase(std::remove_if(_listeners.begin(), _listeners.end(), [&](auto& l) { return l.first == listener; }), _listeners.end());
+		}
 
 		template <class C>
 		Select select(const C& columns) { return { *this, columns }; }
@@ -418,6 +1114,35 @@ namespace db
 
 		Update update(string_view table) { return { *this, table }; }
 
+		template <class C>
+		Insert insert(string_view table, const C& columns) { return { *this, table, columns }; }
+
+		// Holds the writer lock from BEGIN until commit or rollback, so no other
+		// write through this connection ends up inside the transaction
+		class Transaction
+		{
+			Database& _db;
+			std::unique_lock<std::recursive_mutex> _lock;
+			bool _open = true;
+		public:
+			Transaction(Database& db) : _db(db), _lock(db._writer) { _db.query("BEGIN").exec(); }
+			Transaction(const Transaction&) = delete;
+			~Transaction() 
+			{ 
+				if (_open) try { _db.query("ROLLBACK").exec(); }
+				catch (std::exception& e) { std::cout << "Rollback failed: " << e.what() << "\n"; }
+			}
+
+			void commit() { _db.query("COMMIT").exec(); _open = false; }
+		};
+		Transaction transaction() { return { *this }; }
+
+		// Runs a statement that writes, holding the writer lock
+		void exec(Query& q) { std::lock_guard<std::recursive_mutex> lock(_writer); q.exec(); }
+		// Runs a statement that assigns the given columns of a table, holding the
+		// writer lock; assigning the id invalidates the whole table
+		void exec(Query& q, string_view table, const std::vector<string>& assigned);
+
 		template <class Col, class Con>
 		Create create(string_view table, const Col& columns, const Con& constraints) { return { *this, table, columns, constraints }; }
 		Create create(string_view table, const ViewList<ColumnDefinition>& columns, const ViewList<TableConstraint>& constraints) 
@@ -425,6 +1150,42 @@ namespace db
 			return { *this, table, columns, constraints };
 		}
 
+		CreateIndex create(const IndexDefinition& index) { return { *this, index }; }
+
+		class CreateSearch
+		{
+			Database& _db;
+			SearchDefinition _search;
+		public:
+			CreateSearch(Database& db, SearchDefinition search) : _db(db), _search(std::move(search)) { }
+			// Creates the index and its triggers, filling it from the table when new
+			void exec();
+		};
+		CreateSearch create(SearchDefinition search) { return { *this, std::move(search) }; }
+
+		// Rows of table matching an FTS5 query of its search index, best first
+		Query search(string_view table, string_view match, sqlite_int64 limit);
+
+		// Columns that lead some index of the table, and so can be ordered on cheaply
+		std::set<string> indexedColumns(string_view table);
+		std::vector<string> columns(string_view table);
+		std::vector<Reference> references(string_view table);
+
+		// Watch the columns used in WHERE clauses; advisor()->review() reports, or creates, indexes for them
+		void adviseIndexes(bool create) { _advisor = std::make_unique<IndexAdvisor>(create); }
+		IndexAdvisor* advisor() { return _advisor.get(); }
+
+		// Time every statement, logging those that take longer than threshold. Every
+		// row stepped is counted under a lock, so this is for diagnosis, not a default
+		void profile(std::chrono::nanoseconds threshold);
+		Profiler* profiler() { return _profiler.get(); }
+
+		// Sets a PRAGMA and returns the value it reports back, if any
+		string pragma(string_view name, string_view value);
+		void configure(const StorageProfile& profile);
+
+		string filename() const { return sqlite3_db_filename(_handle.get(), "main"); }
+
 		sqlite_int64 lastInsert() { return sqlite3_last_insert_rowid(_handle.get()); }
 	};
 }
@@ -0,0 +1,85 @@
+#include "executor.h"
+
+#include <iostream>
+
+Executor::Executor(size_t thread_count, size_t capacity) : _capacity(capacity)
+{
+	for (size_t i = 0; i < thread_count; ++i)
+		_threads.emplace_back([this] { _work(); });
+}
+
+Executor::~Executor()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+	_wake.notify_all();
+	for (auto&& thread : _threads)
+		thread.join();
+}
+
+bool Executor::submit(const void* key, Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_metrics.queued >= _capacity)
+		{
+			++_metrics.rejected;
+			return false;
+		}
+		auto& queue = _queues[key];
+		// A key is in the ready list while it has work and none of it is running
+		if (queue.empty())
+			_ready.push_back(key);
+		queue.push_back({ std::move(job), Clock::now() });
+		++_metrics.queued;
+	}
+	_wake.notify_one();
+	return true;
+}
+
+void Executor::_work()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (;;)
+	{
+		_wake.wait(lock, [this] { return _stopping || !_ready.empty(); });
+		if (_ready.empty())
+			return;
+
+		const auto key = _ready.front();
+		_ready.pop_front();
+		auto& queue = _queues[key];
+		auto pending = std::move(queue.front());
+
+		const auto wait = Clock::now() - pending.queued;
+		--_metrics.queued;
+		++_metrics.running;
+		_metrics.total_wait += wait;
+		_metrics.max_wait = std::max(_metrics.max_wait, wait);
+
+		lock.unlock();
+		try { pending.job(); }
+		catch (std::exception& e) { std::cout << "Exception in database job: " << e.what() << "\n"; }
+		lock.lock();
+
+		--_metrics.running;
+		++_metrics.completed;
+		auto& rest = _queues[key];
+		rest.pop_front();
+		if (rest.empty())
+			_queues.erase(key);
+		else
+		{
+			_ready.push_back(key);
+			_wake.notify_one();
+		}
+	}
+}
+
+Executor::Metrics Executor::metrics()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _metrics;
+}
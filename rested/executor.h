@@ -0,0 +1,56 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+// Runs database work on its own bounded pool of threads, so that slow queries
+// do not hold up the network threads. Jobs submitted under the same key, such
+// as one connection, run one at a time and in order; keys take turns.
+class Executor
+{
+public:
+	using Job = std::function<void()>;
+	using Clock = std::chrono::steady_clock;
+
+	struct Metrics
+	{
+		size_t queued = 0;
+		size_t running = 0;
+		size_t completed = 0;
+		size_t rejected = 0;
+		Clock::duration total_wait{};
+		Clock::duration max_wait{};
+	};
+private:
+	struct Pending
+	{
+		Job job;
+		Clock::time_point queued;
+	};
+
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::map<const void*, std::deque<Pending>> _queues;
+	std::list<const void*> _ready;
+	const size_t _capacity;
+	Metrics _metrics;
+	bool _stopping = false;
+	std::vector<std::thread> _threads;
+
+	void _work();
+public:
+	Executor(size_t thread_count, size_t capacity);
+	~Executor();
+
+	// Returns false, without running the job, when the queue is full
+	bool submit(const void* key, Job job);
+
+	Metrics metrics();
+};
@@ -88,6 +88,25 @@ class Tab
 
 //function get_json(response: any) { return response.text().then((text: string) => (console.log('recieved:', text), JSON.parse(text))); }
 function get_json(response: Response) : any { return response.json(); }
+function nextLink(response: Response): string
+{
+	const link = response.headers.get('Link');
+	const match = link && link.match(/<([^>]*)>;\s*rel="next"/);
+	return match ? match[1] : null;
+}
+function fetchPages(uri: string, on_page: (data: any[]) => void): Promise<void>
+{
+	return fetch(uri).then(response =>
+	{
+		const next = nextLink(response);
+		return get_json(response).then((data: any[]) =>
+		{
+			on_page(data);
+			if (next)
+				return fetchPages(next, on_page);
+		});
+	});
+}
 function make_element(type: string, text?: string)
 {
     const e = document.createElement(type);
@@ -170,7 +189,7 @@ function makeItem(name: string, on_select: () => void)
 
 interface NameId
 {
-	id: string;
+	id: number;
 	name: string;
 }
 
@@ -190,8 +209,7 @@ function getAllCharacters(state: State)
 {
 	const list = make_element('ul');
 	console.log('fetch characters');
-	fetch('/characters/id,name').then(get_json)
-		.then((data: NameId[]) => makeCharacterItems(list, data, state))
+	fetchPages('/characters/id,name?order=name&limit=200', (data: NameId[]) => makeCharacterItems(list, data, state))
 		.catch(console.log);
 	return list;
 
@@ -201,7 +219,7 @@ function getCharactersAt(place_id: number, state: State)
 {
     const list = make_element('ul');
 	console.log('fetch characters');
-	fetch('/characters/id,name?place=' + (place_id > 0 ? '' + place_id : 'null')).then(get_json)
+	fetch('/characters/id,name?place=' + (place_id > 0 ? '' + place_id : 'isnull:')).then(get_json)
 		.then((data: NameId[]) => makeCharacterItems(list, data, state))
         .catch(console.log);
     return list;
@@ -358,9 +376,9 @@ Panel.generator.place = (id, state) =>
 interface CharacterData
 {
 	[key: string]: any;
-	id: string;
+	id: number;
 	name: string;
-	place: string;
+	place: number;
 }
 
 Panel.generator.character = (id, state) =>
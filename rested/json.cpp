@@ -1,299 +1,1279 @@
 #include "json.h"
 
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <istream>
+#include <ostream>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JSON_SSE2
+#endif
+
 namespace json
 {
-	std::string stringify(std::string_view text)
+	namespace
 	{
-		std::string escaped;
-		escaped += '"';
-		for (auto ch : text) switch (ch)
+		class Error : public std::runtime_error
+		{
+		public:
+			using std::runtime_error::runtime_error;
+		};
+
+		unsigned lowest_bit(uint64_t word)
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward64(&index, word);
+			return index;
+#else
+			return unsigned(__builtin_ctzll(word));
+#endif
+		}
+
+		// The length of the UTF-8 sequence starting at s: 0 when it is invalid, or
+		// more than available when it is cut off but valid so far
+		size_t utf8_sequence(const unsigned char* s, size_t available)
+		{
+			const unsigned c = s[0];
+			if (c < 0x80)
+				return 1;
+			size_t length;
+			unsigned low = 0x80, high = 0xBF;
+			if (c >= 0xC2 && c <= 0xDF)
+				length = 2;
+			else if (c >= 0xE0 && c <= 0xEF)
+			{
+				length = 3;
+				if (c == 0xE0) low = 0xA0;			// Overlong
+				if (c == 0xED) high = 0x9F;			// Surrogates
+			}
+			else if (c >= 0xF0 && c <= 0xF4)
+			{
+				length = 4;
+				if (c == 0xF0) low = 0x90;			// Overlong
+				if (c == 0xF4) high = 0x8F;			// Above U+10FFFF
+			}
+			else
+				return 0;
+
+			for (size_t k = 1; k < length; ++k, low = 0x80, high = 0xBF)
+			{
+				if (k == available)
+					return length;
+				if (s[k] < low || s[k] > high)
+					return 0;
+			}
+			return length;
+		}
+
+		// Where the first byte from i on is that strings cannot hold as it is: a
+		// quote, a backslash, a control character or any byte of a multibyte
+		// sequence, which needs checking. Clean runs are skipped 32 and 16 at a time
+		size_t clean_run(const char* s, size_t i, size_t n)
+		{
+#if defined(__AVX2__)
+			for (; i + 32 <= n; i += 32)
+			{
+				const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+				const __m256i special = _mm256_or_si256(
+					_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+					_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v), v));
+				if (const uint32_t mask = uint32_t(_mm256_movemask_epi8(special)))
+					return i + lowest_bit(mask);
+			}
+#endif
+#if defined(__AVX2__) || defined(JSON_SSE2)
+			for (; i + 16 <= n; i += 16)
+			{
+				const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+				const __m128i special = _mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+					_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v), v));
+				if (const uint32_t mask = uint32_t(_mm_movemask_epi8(special)))
+					return i + lowest_bit(mask);
+			}
+#endif
+			for (; i < n; ++i)
+			{
+				const auto c = static_cast<unsigned char>(s[i]);
+				if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80)
+					break;
+			}
+			return i;
+		}
+	}
+
+	void append(std::string& out, std::string_view text)
+	{
+		static const char hex[] = "0123456789abcdef";
+		const auto bytes = reinterpret_cast<const unsigned char*>(text.data());
+		const size_t n = text.size();
+		out.reserve(out.size() + n + 2);
+		out += '"';
+		size_t clean = 0;
+		for (size_t i = clean_run(text.data(), 0, n); i < n; i = clean_run(text.data(), i, n))
+		{
+			const unsigned c = bytes[i];
+			if (c >= 0x80)
+			{
+				// Valid sequences stay part of the run; anything else is replaced by U+FFFD
+				const size_t length = utf8_sequence(bytes + i, n - i);
+				if (length != 0 && length <= n - i)
+				{
+					i += length;
+					continue;
+				}
+				out.append(text.data() + clean, i - clean).append("\xEF\xBF\xBD");
+				clean = ++i;
+				continue;
+			}
+
+			out.append(text.data() + clean, i - clean);
+			switch (c)
+			{
+			case '"': out.append("\\\""); break;
+			case '\\': out.append("\\\\"); break;
+			case '\b': out.append("\\b"); break;
+			case '\f': out.append("\\f"); break;
+			case '\n': out.append("\\n"); break;
+			case '\r': out.append("\\r"); break;
+			case '\t': out.append("\\t"); break;
+			default:
+			{
+				const char escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+				out.append(escape, sizeof(escape));
+			}
+			}
+			clean = ++i;
+		}
+		out.append(text.data() + clean, n - clean);
+		out += '"';
+	}
+	void append(std::string& out, long long value)
+	{
+		char buf[24];
+		out.append(buf, std::to_chars(buf, buf + sizeof(buf), value).ptr);
+	}
+	void append(std::string& out, double value)
+	{
+		if (!std::isfinite(value))
 		{
-		case '\\': escaped += "\\\\"; continue;
-		case '"': escaped += "\\\""; continue;
-		default: escaped += ch; continue;
+			out.append("null");
+			return;
 		}
-		escaped += '"';
+		char buf[32];
+		out.append(buf, std::to_chars(buf, buf + sizeof(buf), value).ptr);
+	}
+
+	std::string stringify(std::string_view text)
+	{
+		std::string escaped;
+		escaped.reserve(text.size() + 2);
+		append(escaped, text);
 		return escaped;
 	}
 
 	std::string stringify(double value)
 	{
-		auto result = std::to_string(value);
-		while (result.back() == '0')
-			result.pop_back();
-		if (result.back() == '.')
-			result.pop_back();
+		std::string result;
+		append(result, value);
 		return result;
 	}
 
 	std::string stringify(const details::ValueVariant & value)
 	{
-		return std::visit([](const auto& value) { return stringify(value); }, value);
+		std::string result;
+		Writer(result).value(value);
+		return result;
 	}
 
-	template <class IT, class S>
-	class Parser
+	void Writer::_indent()
 	{
-#pragma push_macro("WHITESPACE")
-#pragma push_macro("TOKEN_STOP")
-#pragma push_macro("DIGIT")
-#define WHITESPACE ' ': case '\t': case '\n': case '\r'
-#define TOKEN_STOP WHITESPACE: case ',': case ']': case '}'
-#define DIGIT '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9'
-		IT it;
-		const S end;
-	public:
-		class Error : public std::runtime_error
+		_out += '\n';
+		_out.append(2 * _depth, ' ');
+	}
+	void Writer::_separate()
+	{
+		if (_after_key)
+			_after_key = false;
+		else if (_depth > 0)
 		{
-		public:
-			using std::runtime_error::runtime_error;
-		};
+			if (!_first)
+				_out += ',';
+			if (_pretty)
+				_indent();
+			else if (!_first)
+				_out += ' ';
+		}
+		_first = false;
+	}
+	void Writer::_spill()
+	{
+		if (_sink && _out.size() >= (1 << 14))
+			flush();
+	}
+	void Writer::flush()
+	{
+		if (!_sink || _out.empty())
+			return;
+		_sink->write(_out.data(), std::streamsize(_out.size()));
+		_out.clear();
+	}
+
+	Writer& Writer::beginArray()
+	{
+		_separate();
+		_out.append(_pretty ? "[" : "[ ");
+		++_depth;
+		_first = true;
+		return *this;
+	}
+	Writer& Writer::endArray()
+	{
+		--_depth;
+		if (!_pretty)
+			_out += ' ';
+		else if (!_first)
+			_indent();
+		_out += ']';
+		_first = false;
+		_spill();
+		return *this;
+	}
+	Writer& Writer::beginObject()
+	{
+		_separate();
+		_out.append(_pretty ? "{" : "{ ");
+		++_depth;
+		_first = true;
+		return *this;
+	}
+	Writer& Writer::endObject()
+	{
+		--_depth;
+		if (!_pretty)
+			_out += ' ';
+		else if (!_first)
+			_indent();
+		_out += '}';
+		_first = false;
+		_spill();
+		return *this;
+	}
+	Writer& Writer::key(std::string_view name)
+	{
+		_separate();
+		append(_out, name);
+		_out.append(": ");
+		_after_key = true;
+		return *this;
+	}
+	Writer& Writer::quotedKey(std::string_view quoted)
+	{
+		_separate();
+		_out.append(quoted);
+		_after_key = true;
+		return *this;
+	}
+
+	Writer& Writer::value(nullptr_t)
+	{
+		_separate();
+		_out.append("null");
+		return *this;
+	}
+	Writer& Writer::value(bool value)
+	{
+		_separate();
+		_out.append(value ? "true" : "false");
+		return *this;
+	}
+	Writer& Writer::value(double value)
+	{
+		_separate();
+		append(_out, value);
+		return *this;
+	}
+	Writer& Writer::value(long long value)
+	{
+		_separate();
+		append(_out, value);
+		return *this;
+	}
+	Writer& Writer::value(std::string_view text)
+	{
+		_separate();
+		append(_out, text);
+		_spill();
+		return *this;
+	}
+	Writer& Writer::value(const details::ValueVariant& value)
+	{
+		return std::visit([this](const auto& v) -> Writer& { return this->value(v); }, value);
+	}
+	Writer& Writer::raw(std::string_view json)
+	{
+		_separate();
+		_out.append(json);
+		_spill();
+		return *this;
+	}
+
+	// Parsing runs in two stages. The first finds, 64 bytes at a time, every
+	// structural character outside strings, every unescaped quote and the start
+	// of every other scalar, and checks the UTF-8 on the way. The second walks
+	// those positions to build values, so it never looks at the bytes between.
+	namespace
+	{
+		constexpr size_t block_size = 64;
 
-		Parser(IT it, S end) : it(it), end(end) { }
+		// Sets every bit from each set bit up to, not including, the next one
+		uint64_t prefix_xor(uint64_t bits)
+		{
+			bits ^= bits << 1;
+			bits ^= bits << 2;
+			bits ^= bits << 4;
+			bits ^= bits << 8;
+			bits ^= bits << 16;
+			bits ^= bits << 32;
+			return bits;
+		}
 
-		Value operator()()
+		// One bit per byte of a block for each class of character
+		struct Block
 		{
-			for (;;) switch (safe_next())
+			uint64_t quote = 0;
+			uint64_t backslash = 0;
+			uint64_t op = 0;			// { } [ ] : ,
+			uint64_t space = 0;
+			uint64_t control = 0;
+			uint64_t high = 0;			// Part of a multibyte UTF-8 sequence
+
+			explicit Block(const char* p)
 			{
-			case WHITESPACE: ++it; continue;
-			case 'n': assert_rest("null"); return nullptr;
-			case 't': assert_rest("true"); return true;
-			case 'f': assert_rest("false"); return false;
-			case '-': case DIGIT:
-				return parse_number();
-			case '"': return parse_string();
-			case '[': return parse_array();
-			case '{': return parse_object();
-			default:
-				throw Error("Not a valid value");
+#if defined(__AVX2__)
+				for (unsigned half = 0; half < 2; ++half)
+				{
+					const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * half));
+					auto mask = [half](__m256i m) { return uint64_t(uint32_t(_mm256_movemask_epi8(m))) << (32 * half); };
+					auto eq = [&v](char c) { return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)); };
+					// Setting bit 5 turns [ and ] into { and }, and nothing else into either
+					const __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+					quote |= mask(eq('"'));
+					backslash |= mask(eq('\\'));
+					op |= mask(_mm256_or_si256(
+						_mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))),
+						_mm256_or_si256(eq(':'), eq(','))));
+					space |= mask(_mm256_or_si256(_mm256_or_si256(eq(' '), eq('\t')), _mm256_or_si256(eq('\n'), eq('\r'))));
+					control |= mask(_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v));
+					high |= mask(v);
+				}
+#elif defined(JSON_SSE2)
+				for (unsigned quarter = 0; quarter < 4; ++quarter)
+				{
+					const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * quarter));
+					auto mask = [quarter](__m128i m) { return uint64_t(uint16_t(_mm_movemask_epi8(m))) << (16 * quarter); };
+					auto eq = [&v](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+					const __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+					quote |= mask(eq('"'));
+					backslash |= mask(eq('\\'));
+					op |= mask(_mm_or_si128(
+						_mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+						_mm_or_si128(eq(':'), eq(','))));
+					space |= mask(_mm_or_si128(_mm_or_si128(eq(' '), eq('\t')), _mm_or_si128(eq('\n'), eq('\r'))));
+					control |= mask(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v));
+					high |= mask(v);
+				}
+#else
+				for (unsigned i = 0; i < block_size; ++i)
+				{
+					const auto c = static_cast<unsigned char>(p[i]);
+					const uint64_t bit = uint64_t(1) << i;
+					if (c == '"') quote |= bit;
+					if (c == '\\') backslash |= bit;
+					if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') op |= bit;
+					if (c == ' ' || c == '\t' || c == '\n' || c == '\r') space |= bit;
+					if (c < 0x20) control |= bit;
+					if (c >= 0x80) high |= bit;
+				}
+#endif
 			}
-		}
-	private:
-		void assert_rest(const char* s)
+		};
+
+		// Checks the UTF-8 in s[from, to). Returns where a sequence cut off by to
+		// starts, so that the next call picks it up, or to
+		size_t check_utf8(const unsigned char* s, size_t from, size_t to)
 		{
-			for (; *s != 0; ++s, ++it)
-				if (it == end || *s != *it)
-					throw Error("Invalid value");
-			if (it != end) switch (*it)
+			size_t i = from;
+			while (i < to)
 			{
-			case TOKEN_STOP: return;
-			default: throw Error("Invalid value");
+				const size_t length = utf8_sequence(s + i, to - i);
+				if (length == 0)
+					throw Error("Invalid UTF-8");
+				if (length > to - i)
+					return i;
+				i += length;
 			}
+			return i;
 		}
-		char safe_next() { return it == end ? ',' : *it; }
 
-		struct ToDigit
+		// Stage one. Carries its state from block to block, so text may arrive in pieces
+		class Indexer
 		{
-			char mask;
-			char shift;
+			uint64_t _escaped = 0;		// The first byte of the next block follows an odd run of backslashes
+			uint64_t _in_string = 0;	// All ones when the next block starts inside a string
+			uint64_t _scalar = 0;		// The previous block ended within a scalar
+			size_t _utf8 = 0;			// Everything before is valid UTF-8
 
-			ToDigit(bool negate) : mask(negate ? ~0 : 0), shift('0' + negate) { }
+			// The bytes escaped by a backslash, counting runs of backslashes in pairs
+			uint64_t _escapes(uint64_t backslash)
+			{
+				constexpr uint64_t even_bits = 0x5555555555555555ULL;
+				backslash &= ~_escaped;
+				const uint64_t follows_escape = backslash << 1 | _escaped;
+				const uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+				const uint64_t even_starts = odd_starts + backslash;
+				_escaped = even_starts < odd_starts;
+				return (even_bits ^ even_starts << 1) & follows_escape;
+			}
 
-			char operator()(char ch) { return (ch - shift) ^ mask; }
-		};
-		double parse_number()
-		{
-			auto to_digit = [this]
+			void _block(const Block& block, const char* data, size_t base, size_t end, std::vector<uint32_t>& out)
 			{
-				const bool neg = *it == '-';
-				if (neg) ++it;
-				return ToDigit(neg);
-			}();
-			if (safe_next() == '0')
+				const uint64_t quotes = block.quote & ~_escapes(block.backslash);
+				// Opening quotes and what follows them, up to the closing quote
+				const uint64_t in_string = prefix_xor(quotes) ^ _in_string;
+				_in_string = uint64_t(int64_t(in_string) >> 63);
+				if (block.control & in_string)
+					throw Error("Control character in string");
+
+				const uint64_t scalar = ~(block.op | block.space | quotes | in_string);
+				const uint64_t starts = scalar & ~(scalar << 1 | _scalar);
+				_scalar = scalar >> 63;
+
+				if (block.high || _utf8 < base)
+					_utf8 = check_utf8(reinterpret_cast<const unsigned char*>(data), _utf8, end);
+				else
+					_utf8 = end;
+
+				for (uint64_t bits = (block.op & ~in_string) | quotes | starts; bits; bits &= bits - 1)
+					out.push_back(uint32_t(base + lowest_bit(bits)));
+			}
+		public:
+			// Indexes data[from, to), a whole number of blocks unless last
+			void operator()(const char* data, size_t from, size_t to, bool last, std::vector<uint32_t>& out)
 			{
-				++it;
-				switch (safe_next())
+				if (to > UINT32_MAX)
+					throw Error("JSON text too large");
+				size_t base = from;
+				for (; base + block_size <= to; base += block_size)
+					_block(Block(data + base), data, base, base + block_size, out);
+				if (!last)
+					return;
+				if (base < to)
 				{
-				case TOKEN_STOP: return 0;
-				case '.':           ++it; return parse_decimals(to_digit, 0);
-				case 'E': case 'e': ++it; return parse_exponent(0);
-				default: throw Error("Unexpected character while parsing number with initial zero");
+					char padded[block_size];
+					std::fill(std::copy(data + base, data + to, padded), padded + block_size, ' ');
+					_block(Block(padded), data, base, to, out);
 				}
+				if (_in_string)
+					throw Error("Unexpected end of data while parsing string");
+				if (_utf8 < to)
+					throw Error("Invalid UTF-8");
 			}
-			double n = 0;
-			for (;;) switch (safe_next())
+
+			// Where the next call can start checking UTF-8 from; text before that may be dropped
+			size_t pending() const { return _utf8; }
+			void dropped(size_t count) { _utf8 -= count; }
+		};
+
+		bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+		bool is_number(std::string_view text)
+		{
+			auto it = text.begin();
+			const auto end = text.end();
+			auto digits = [&]
 			{
-			case TOKEN_STOP: return n;
-			case DIGIT:
-				n = n * 10 + to_digit(*it);
+				const auto start = it;
+				while (it != end && *it >= '0' && *it <= '9')
+					++it;
+				return it != start;
+			};
+			if (it != end && *it == '-')
 				++it;
-				continue;
-			case '.':           ++it; return parse_decimals(to_digit, n);
-			case 'E': case 'e': ++it; return parse_exponent(n);
-			default: throw Error("Unexpected character while parsing integer");
+			if (it != end && *it == '0')
+				++it;
+			else if (!digits())
+				return false;
+			if (it != end && *it == '.' && (++it, !digits()))
+				return false;
+			if (it != end && (*it == 'e' || *it == 'E'))
+			{
+				++it;
+				if (it != end && (*it == '+' || *it == '-'))
+					++it;
+				if (!digits())
+					return false;
 			}
-		};
-		double parse_decimals(ToDigit to_digit, double n)
+			return it == end;
+		}
+
+		// The code unit of the four hex digits at raw[at]
+		unsigned hex4(std::string_view raw, size_t at)
 		{
-			double q = 1;
-			switch (safe_next())
+			if (raw.size() < at + 4)
+				throw Error("Invalid unicode escape");
+			unsigned code = 0;
+			for (char c : raw.substr(at, 4))
 			{
-			case TOKEN_STOP: throw Error("Number ended with Period");
-			default: break;
+				code <<= 4;
+				if (c >= '0' && c <= '9') code |= unsigned(c - '0');
+				else if (c >= 'a' && c <= 'f') code |= unsigned(c - 'a' + 10);
+				else if (c >= 'A' && c <= 'F') code |= unsigned(c - 'A' + 10);
+				else throw Error("Invalid unicode escape");
 			}
-			for (;;) switch (safe_next())
+			return code;
+		}
+
+		char* encode_utf8(unsigned code, char* out)
+		{
+			if (code < 0x80)
+				*out++ = char(code);
+			else if (code < 0x800)
 			{
-			case TOKEN_STOP:
-				return n / q;
-			case DIGIT:
-				q *= 10;
-				n = n * 10 + to_digit(*it);
-				++it;
-				continue;
-			case 'E': case 'e': ++it; return parse_exponent(n / q);
-			default: throw Error("Unexpected character while parsing decimal number");
+				*out++ = char(0xC0 | code >> 6);
+				*out++ = char(0x80 | (code & 0x3F));
 			}
-		};
-		double parse_exponent(double n)
+			else if (code < 0x10000)
+			{
+				*out++ = char(0xE0 | code >> 12);
+				*out++ = char(0x80 | (code >> 6 & 0x3F));
+				*out++ = char(0x80 | (code & 0x3F));
+			}
+			else
+			{
+				*out++ = char(0xF0 | code >> 18);
+				*out++ = char(0x80 | (code >> 12 & 0x3F));
+				*out++ = char(0x80 | (code >> 6 & 0x3F));
+				*out++ = char(0x80 | (code & 0x3F));
+			}
+			return out;
+		}
+
+		// Unescapes raw string text into out, which needs room for raw.size()
+		// characters, as nothing unescapes to more than its escape sequence: six
+		// characters of \uXXXX make at most three bytes, and twelve of a
+		// surrogate pair make four
+		size_t unescape(std::string_view raw, char* out)
 		{
-			auto to_digit = [this]() -> ToDigit
+			char* const start = out;
+			for (auto escape = raw.find('\\');; escape = raw.find('\\'))
 			{
-				switch (safe_next())
+				out = std::copy(raw.begin(), escape == std::string_view::npos ? raw.end() : raw.begin() + escape, out);
+				if (escape == std::string_view::npos)
+					return size_t(out - start);
+				size_t length = 2;
+				switch (raw[escape + 1])
 				{
-				case TOKEN_STOP: throw Error("Number ended with exponent symbol");
-				case '+': ++it; return false;
-				case '-': ++it; return true;
-				default: return false;
+				case '"': case '\\': case '/': *out++ = raw[escape + 1]; break;
+				case 'b': *out++ = '\b'; break;
+				case 'f': *out++ = '\f'; break;
+				case 'n': *out++ = '\n'; break;
+				case 'r': *out++ = '\r'; break;
+				case 't': *out++ = '\t'; break;
+				case 'u':
+				{
+					unsigned code = hex4(raw, escape + 2);
+					length = 6;
+					if (code >= 0xD800 && code <= 0xDBFF)
+					{
+						// Characters beyond the basic plane come as a pair of UTF-16 surrogates
+						if (raw.substr(escape + 6, 2) != "\\u")
+							throw Error("Unpaired surrogate in unicode escape");
+						const unsigned low = hex4(raw, escape + 8);
+						if (low < 0xDC00 || low > 0xDFFF)
+							throw Error("Unpaired surrogate in unicode escape");
+						code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+						length = 12;
+					}
+					else if (code >= 0xDC00 && code <= 0xDFFF)
+						throw Error("Unpaired surrogate in unicode escape");
+					out = encode_utf8(code, out);
+					break;
+				}
+				default:
+					throw Error("Invalid escape character");
 				}
-			}();
-			switch (safe_next())
+				raw.remove_prefix(escape + length);
+			}
+		}
+
+		// Null, true, false or a number
+		Value scalar(std::string_view text)
+		{
+			if (text == "null")
+				return nullptr;
+			if (text == "true")
+				return true;
+			if (text == "false")
+				return false;
+			if (!is_number(text))
+				throw Error("Not a valid value");
+			if (text.find_first_of(".eE") == std::string_view::npos)
+			{
+				Integer integer;
+				if (std::from_chars(text.data(), text.data() + text.size(), integer).ec == std::errc())
+					return integer;
+			}
+			// Correctly rounded, which also takes integers too large for Integer
+			double number;
+			if (std::from_chars(text.data(), text.data() + text.size(), number).ec != std::errc())
+				throw Error("Number out of range");
+			return number;
+		}
+
+		// Stage two walks the positions found by the indexer
+		class Tokens
+		{
+			const char* _data;
+			const uint32_t* _token;
+			const uint32_t* const _last;
+			const size_t _end;			// Where the text after the final token ends
+		public:
+			Tokens(const char* data, const uint32_t* first, const uint32_t* last, size_t end) :
+				_data(data), _token(first), _last(last), _end(end) { }
+
+			bool done() const { return _token == _last; }
+			char peek() const { return _token == _last ? '\0' : _data[*_token]; }
+			void skip() { ++_token; }
+			void expect(char c, const char* error)
+			{
+				if (peek() != c)
+					throw Error(error);
+				++_token;
+			}
+
+			// The text between the quotes, still escaped
+			std::string_view string()
 			{
-			case TOKEN_STOP: throw Error("Number ended with exponent sign");
-			default: break;
+				if (_token + 1 == _last || _data[_token[1]] != '"')
+					throw Error("Unexpected end of data while parsing string");
+				std::string_view raw(_data + _token[0] + 1, _token[1] - _token[0] - 1);
+				_token += 2;
+				return raw;
 			}
-			int p = 0;
-			while (it != end) switch (*it)
+			std::string_view scalar()
 			{
-			case TOKEN_STOP: break;
-			case DIGIT: p = p * 10 + to_digit(*it);
-			default: throw Error("Unexpected character while parsing exponent");
+				const size_t start = *_token++;
+				const size_t limit = _token == _last ? _end : *_token;
+				size_t stop = start;
+				while (stop < limit && !is_space(_data[stop]))
+					++stop;
+				return { _data + start, stop - start };
 			}
-			return n * pow(10.0, p);
 		};
-		std::string parse_string()
+
+		class Builder
 		{
-			[this] {
-				for (;;) switch (safe_next())
+			Tokens _tokens;
+
+			std::string _string()
+			{
+				const auto raw = _tokens.string();
+				if (raw.find('\\') == std::string_view::npos)
+					return std::string(raw);
+				std::string result(raw.size(), '\0');
+				result.resize(unescape(raw, result.data()));
+				return result;
+			}
+			Array _array()
+			{
+				Array a;
+				_tokens.skip();
+				if (_tokens.peek() == ']')
 				{
-				case WHITESPACE: ++it; continue;
-				case '"': ++it; return;
-				default: throw Error("Invalid start of string");
+					_tokens.skip();
+					return a;
 				}
-			}();
-			std::string result;
-			while (it != end) switch (*it)
+				for (;;)
+				{
+					a.push_back(value());
+					switch (_tokens.peek())
+					{
+					case ',': _tokens.skip(); continue;
+					case ']': _tokens.skip(); return a;
+					default: throw Error("Invalid character after array item");
+					}
+				}
+			}
+			Object _object()
 			{
-			case '"': ++it; return result;
-			case '\'':
-				++it;
-				switch (safe_next())
+				Object o;
+				_tokens.skip();
+				if (_tokens.peek() == '}')
 				{
-				case '"': case '\\': case '/': result.push_back(*it); break;
-				case 'b': result.push_back('\b'); break;
-				case 'f': result.push_back('\f'); break;
-				case 'n': result.push_back('\n'); break;
-				case 'r': result.push_back('\r'); break;
-				case 't': result.push_back('\t'); break;
-				case 'u':
-					throw Error("Unicode codepoints in strings not implemented");
-				default:
-					throw Error("Invalid escape character");
+					_tokens.skip();
+					return o;
+				}
+				for (;;)
+				{
+					if (_tokens.peek() != '"')
+						throw Error("Invalid start of string");
+					auto key = _string();
+					_tokens.expect(':', "Unexpected character after property name");
+					o.emplace_back(std::move(key), value());
+					switch (_tokens.peek())
+					{
+					case ',': _tokens.skip(); continue;
+					case '}': _tokens.skip(); return o;
+					default: throw Error("Invalid character after object value");
+					}
+				}
+			}
+		public:
+			Builder(const char* data, const uint32_t* first, const uint32_t* last, size_t end) : _tokens(data, first, last, end) { }
+
+			bool done() const { return _tokens.done(); }
+
+			Value value()
+			{
+				switch (_tokens.peek())
+				{
+				case '\0': throw Error("Unexpected end of data");
+				case '{': return _object();
+				case '[': return _array();
+				case '"': return _string();
+				case '}': case ']': case ':': case ',':
+					throw Error("Not a valid value");
+				default: return scalar(_tokens.scalar());
 				}
-				++it;
-				continue;
-			default:
-				result.push_back(*it);
-				++it;
-				continue;
 			}
-			throw Error("Unexpected end of data while parsing string");
 		};
-		Array parse_array()
+
+		// Reports what it finds to a Handler instead of building anything
+		class Events
 		{
-			[this] {
-				for (;;) switch (safe_next())
+			Tokens _tokens;
+			Handler& _handler;
+			std::string _unescaped;
+
+			std::string_view _string()
+			{
+				const auto raw = _tokens.string();
+				if (raw.find('\\') == std::string_view::npos)
+					return raw;
+				_unescaped.resize(raw.size());
+				_unescaped.resize(unescape(raw, _unescaped.data()));
+				return _unescaped;
+			}
+			void _array()
+			{
+				_handler.onBeginArray();
+				_tokens.skip();
+				if (_tokens.peek() == ']')
+					_tokens.skip();
+				else for (bool more = true; more;)
 				{
-				case WHITESPACE: ++it; continue;
-				case '[': ++it; return;
-				default: throw Error("Invalid start of array");
+					value();
+					switch (_tokens.peek())
+					{
+					case ',': _tokens.skip(); continue;
+					case ']': _tokens.skip(); more = false; continue;
+					default: throw Error("Invalid character after array item");
+					}
 				}
-			}();
-			auto parse_item = [this]
+				_handler.onEndArray();
+			}
+			void _object()
 			{
-				Value result = operator()();
-				while (it != end) switch (*it)
+				_handler.onBeginObject();
+				_tokens.skip();
+				if (_tokens.peek() == '}')
+					_tokens.skip();
+				else for (bool more = true; more;)
 				{
-				case WHITESPACE: ++it; continue;
-				case ']':       return result;
-				case ',': ++it; return result;
-				default: throw Error("Invalid character after array item");
+					if (_tokens.peek() != '"')
+						throw Error("Invalid start of string");
+					_handler.onKey(_string());
+					_tokens.expect(':', "Unexpected character after property name");
+					value();
+					switch (_tokens.peek())
+					{
+					case ',': _tokens.skip(); continue;
+					case '}': _tokens.skip(); more = false; continue;
+					default: throw Error("Invalid character after object value");
+					}
 				}
-				throw Error("Unexpected end of data while parsing array");
-			};
-			Array a;
-			for (;;) switch (safe_next())
+				_handler.onEndObject();
+			}
+			void _scalar()
 			{
-			case WHITESPACE: ++it; continue;
-			case ']': ++it; return a;
-			case '}': case ',':
-				throw Error("Invalid termination of array");
-			default:
-				a.emplace_back(parse_item());
-				continue;
+				auto value = scalar(_tokens.scalar());
+				if (auto b = std::get_if<bool>(&value))
+					_handler.onBool(*b);
+				else if (auto i = std::get_if<Integer>(&value))
+					_handler.onInteger(*i);
+				else if (auto d = std::get_if<double>(&value))
+					_handler.onNumber(*d);
+				else
+					_handler.onNull();
 			}
-		};
-		Object parse_object()
-		{
-			[this] {
-				for (;;) switch (safe_next())
+		public:
+			Events(Handler& handler, const char* data, const uint32_t* first, const uint32_t* last, size_t end) :
+				_tokens(data, first, last, end), _handler(handler) { }
+
+			bool done() const { return _tokens.done(); }
+
+			void value()
+			{
+				switch (_tokens.peek())
 				{
-				case WHITESPACE: ++it; continue;
-				case '{': ++it; return;
-				default: throw Error("Invalid start of object");
+				case '\0': throw Error("Unexpected end of data");
+				case '{': return _object();
+				case '[': return _array();
+				case '"': return _handler.onString(_string());
+				case '}': case ']': case ':': case ',':
+					throw Error("Not a valid value");
+				default: return _scalar();
 				}
-			}();
-			auto parse_item = [this]
+			}
+		};
+
+		// Reads an array in chunks, calling build(data, first, last, end) for the
+		// tokens of each element once the comma or bracket after it has been indexed
+		template <class Build>
+		void each(std::istream& in, Build&& build)
+		{
+			constexpr size_t chunk = 1 << 16;
+
+			std::string buffer;
+			std::vector<uint32_t> index;
+			Indexer indexer;
+			size_t indexed = 0;			// Bytes of the buffer covered by the index
+			size_t scanned = 0;			// Index entries looked at
+			size_t first = 0;			// Index entry starting the current element
+			size_t depth = 0;
+			size_t count = 0;			// Elements handed over
+			for (bool last = false; !last;)
 			{
-				auto parse_value = [this]
+				const size_t size = buffer.size();
+				buffer.resize(size + chunk);
+				in.read(buffer.data() + size, chunk);
+				buffer.resize(size + size_t(in.gcount()));
+				last = !in;
+
+				const size_t to = last ? buffer.size() : indexed + (buffer.size() - indexed) / block_size * block_size;
+				indexer(buffer.data(), indexed, to, last, index);
+				indexed = to;
+
+				for (; scanned < index.size(); ++scanned)
 				{
-					Value result = operator()();
-					while (it != end) switch (*it)
+					const char c = buffer[index[scanned]];
+					if (depth == 0)
 					{
-					case WHITESPACE: ++it; continue;
-					case '}': return result;
-					case ',': ++it; return result;
-					default: throw Error("Invalid character after object value");
+						if (scanned != 0 || c != '[')
+							throw Error("Invalid start of array");
+						depth = 1;
+						first = 1;
+						continue;
+					}
+					if (c == '{' || c == '[')
+						++depth;
+					else if ((c == '}' || c == ']') && depth > 1)
+						--depth;
+					else if (depth == 1 && (c == ',' || c == ']'))
+					{
+						if (first == scanned)
+						{
+							if (c == ',' || count != 0)
+								throw Error("Invalid termination of array");
+							return;
+						}
+						build(buffer.data(), index.data() + first, index.data() + scanned, size_t(index[scanned]));
+						++count;
+						if (c == ']')
+							return;
+						first = scanned + 1;
 					}
-					throw Error("Unexpected end of data while parsing object");
-				};
-				std::string key = parse_string();
-				for (;;) switch (safe_next())
+				}
+
+				// Drop the elements already handed over
+				const size_t keep = std::min(first < index.size() ? size_t(index[first]) : indexed, indexer.pending());
+				if (keep > 0 && depth > 0)
 				{
-				case WHITESPACE: ++it; continue;
-				case ':': ++it; return std::make_pair(key, parse_value());
-				default: throw Error("Unexpected character after property name");
+					buffer.erase(0, keep);
+					index.erase(index.begin(), index.begin() + first);
+					for (auto& position : index)
+						position -= uint32_t(keep);
+					scanned -= first;
+					first = 0;
+					indexed -= keep;
+					indexer.dropped(keep);
 				}
-			};
+			}
+			throw Error("Unexpected end of data while parsing array");
+		}
+	}
+
+	Value parse(std::string_view stored)
+	{
+		std::vector<uint32_t> index;
+		index.reserve(stored.size() / 8);
+		Indexer()(stored.data(), 0, stored.size(), true, index);
+
+		Builder builder(stored.data(), index.data(), index.data() + index.size(), stored.size());
+		auto result = builder.value();
+		if (!builder.done())
+			throw Error("Unexpected data after value");
+		return result;
+	}
+
+	void parseEach(std::istream& in, const std::function<void(Value&&)>& element)
+	{
+		each(in, [&](const char* data, const uint32_t* first, const uint32_t* last, size_t end)
+		{
+			Builder builder(data, first, last, end);
+			auto value = builder.value();
+			if (!builder.done())
+				throw Error("Invalid character after array item");
+			element(std::move(value));
+		});
+	}
+
+	void parse(std::string_view text, Handler& handler)
+	{
+		std::vector<uint32_t> index;
+		index.reserve(text.size() / 8);
+		Indexer()(text.data(), 0, text.size(), true, index);
+
+		Events events(handler, text.data(), index.data(), index.data() + index.size(), text.size());
+		events.value();
+		if (!events.done())
+			throw Error("Unexpected data after value");
+	}
+
+	void parseEach(std::istream& in, Handler& handler)
+	{
+		each(in, [&](const char* data, const uint32_t* first, const uint32_t* last, size_t end)
+		{
+			Events events(handler, data, first, last, end);
+			events.value();
+			if (!events.done())
+				throw Error("Invalid character after array item");
+		});
+	}
+
+	void* Document::Arena::allocate(size_t size, size_t align)
+	{
+		const size_t padding = (align - reinterpret_cast<uintptr_t>(_next) % align) % align;
+		if (padding + size > _left)
+		{
+			// Blocks double, so a document of any size takes a handful of them
+			if (!_blocks.empty())
+				_block *= 2;
+			const size_t block = std::max(_block, size + align);
+			_blocks.push_back(std::make_unique<char[]>(block));
+			_next = _blocks.back().get();
+			_left = block;
+			return allocate(size, align);
+		}
+		void* result = _next + padding;
+		_next += padding + size;
+		_left -= padding + size;
+		return result;
+	}
+	void Document::Arena::clear()
+	{
+		if (_blocks.empty())
+			return;
+		auto largest = std::move(_blocks.back());
+		_blocks.clear();
+		_blocks.push_back(std::move(largest));
+		_next = _blocks.back().get();
+		_left = _block;
+	}
+
+	namespace
+	{
+		size_t table_size(size_t members)
+		{
+			size_t size = 1;
+			while (size < 2 * members)
+				size *= 2;
+			return size;
+		}
+	}
+
+	void read(const Document::Node& node, int& out)
+	{
+		const auto value = node.integer();
+		if (value < std::numeric_limits<int>::min() || value > std::numeric_limits<int>::max())
+			throw std::runtime_error("Number out of range");
+		out = int(value);
+	}
+
+	void Document::Node::_expect(Type type) const
+	{
+		static const char* const names[] = { "null", "a boolean", "an integer", "a number", "a string", "an array", "an object" };
+		if (_type != type)
+			throw std::runtime_error(std::string("Expected ") + names[int(type)] + " in JSON, not " + names[int(_type)]);
+	}
+	double Document::Node::number() const
+	{
+		if (_type == Type::Integer)
+			return double(_integer);
+		_expect(Type::Double);
+		return _number;
+	}
+	Document::Range<Document::Member> Document::Node::members() const
+	{
+		_expect(Type::Object);
+		return { _members, _members + _size };
+	}
+	const Document::Node* Document::Node::find(std::string_view key) const
+	{
+		if (_type != Type::Object)
+			return nullptr;
+		if (_size > indexed)
+		{
+			const auto table = reinterpret_cast<const uint32_t*>(_members + _size);
+			const size_t mask = table_size(_size) - 1;
+			for (size_t slot = std::hash<std::string_view>()(key) & mask; table[slot] != 0; slot = (slot + 1) & mask)
+				if (_members[table[slot] - 1].key == key)
+					return &_members[table[slot] - 1].value;
+			return nullptr;
+		}
+		for (auto& member : members())
+			if (member.key == key)
+				return &member.value;
+		return nullptr;
+	}
+	Value Document::Node::value() const
+	{
+		switch (_type)
+		{
+		case Type::Null: return nullptr;
+		case Type::Bool: return _boolean;
+		case Type::Integer: return _integer;
+		case Type::Double: return _number;
+		case Type::String: return std::string(_text, _size);
+		case Type::Array:
+		{
+			Array a;
+			a.reserve(_size);
+			for (auto& e : elements())
+				a.push_back(e.value());
+			return a;
+		}
+		case Type::Object:
+		{
 			Object o;
-			for (;;) switch (safe_next())
+			o.reserve(_size);
+			for (auto& m : members())
+				o.emplace_back(std::string(m.key), m.value.value());
+			return o;
+		}
+		}
+		return nullptr;
+	}
+
+	std::string_view Document::_intern(std::string_view key)
+	{
+		auto found = _keys.find(key);
+		if (found != _keys.end())
+			return *found;
+		auto copy = static_cast<char*>(_key_arena.allocate(key.size(), 1));
+		std::copy(key.begin(), key.end(), copy);
+		return *_keys.emplace(copy, key.size()).first;
+	}
+
+	class Document::Builder
+	{
+		Document& _doc;
+		Tokens _tokens;
+
+		void* _allocate(size_t size, size_t align) { return _doc._arena.allocate(size, align); }
+
+		Node _string()
+		{
+			Node node;
+			node._type = Type::String;
+			const auto raw = _tokens.string();
+			if (raw.find('\\') == std::string_view::npos)
+				node._text = raw.data();
+			else
 			{
-			case WHITESPACE: ++it; continue;
-			case '}': ++it; return o;
-			case ']': case ',':
-				throw Error("Invaid termination of object");
-			default:
-				o.emplace_back(parse_item());
-				continue;
+				auto text = static_cast<char*>(_allocate(raw.size(), 1));
+				node._text = text;
+				node._size = uint32_t(unescape(raw, text));
+				return node;
 			}
-		};
+			node._size = uint32_t(raw.size());
+			return node;
+		}
+		std::string_view _key()
+		{
+			const auto raw = _tokens.string();
+			if (raw.find('\\') == std::string_view::npos)
+				return _doc._intern(raw);
+			_doc._unescaped.resize(raw.size());
+			_doc._unescaped.resize(unescape(raw, _doc._unescaped.data()));
+			return _doc._intern(_doc._unescaped);
+		}
+		Node _scalar()
+		{
+			Node node;
+			auto value = scalar(_tokens.scalar());
+			if (auto b = std::get_if<bool>(&value))
+			{
+				node._type = Type::Bool;
+				node._boolean = *b;
+			}
+			else if (auto i = std::get_if<Integer>(&value))
+			{
+				node._type = Type::Integer;
+				node._integer = *i;
+			}
+			else if (auto d = std::get_if<double>(&value))
+			{
+				node._type = Type::Double;
+				node._number = *d;
+			}
+			return node;
+		}
+		Node _array()
+		{
+			auto& nodes = _doc._nodes;
+			const size_t base = nodes.size();
+			_tokens.skip();
+			if (_tokens.peek() == ']')
+				_tokens.skip();
+			else for (bool more = true; more;)
+			{
+				auto element = value();
+				nodes.push_back(element);
+				switch (_tokens.peek())
+				{
+				case ',': _tokens.skip(); continue;
+				case ']': _tokens.skip(); more = false; continue;
+				default: throw Error("Invalid character after array item");
+				}
+			}
+
+			Node node;
+			node._type = Type::Array;
+			node._size = uint32_t(nodes.size() - base);
+			auto elements = static_cast<Node*>(_allocate(sizeof(Node) * node._size, alignof(Node)));
+			std::copy(nodes.begin() + base, nodes.end(), elements);
+			node._elements = elements;
+			nodes.resize(base);
+			return node;
+		}
+		Node _object()
+		{
+			auto& members = _doc._members;
+			const size_t base = members.size();
+			_tokens.skip();
+			if (_tokens.peek() == '}')
+				_tokens.skip();
+			else for (bool more = true; more;)
+			{
+				if (_tokens.peek() != '"')
+					throw Error("Invalid start of string");
+				auto key = _key();
+				_tokens.expect(':', "Unexpected character after property name");
+				auto member = value();
+				members.push_back({ key, member });
+				switch (_tokens.peek())
+				{
+				case ',': _tokens.skip(); continue;
+				case '}': _tokens.skip(); more = false; continue;
+				default: throw Error("Invalid character after object value");
+				}
+			}
+
+			Node node;
+			node._type = Type::Object;
+			node._size = uint32_t(members.size() - base);
+			const size_t table = node._size > Node::indexed ? table_size(node._size) : 0;
+			auto copy = static_cast<Member*>(_allocate(sizeof(Member) * node._size + sizeof(uint32_t) * table, alignof(Member)));
+			std::copy(members.begin() + base, members.end(), copy);
+			node._members = copy;
+			members.resize(base);
 
-#pragma pop_macro("DIGIT")
-#pragma pop_macro("TOKEN_STOP")
-#pragma pop_macro("WHITESPACE")
+			if (table != 0)
+			{
+				// Slots hold member positions plus one, so that zero marks an empty slot
+				const auto slots = reinterpret_cast<uint32_t*>(copy + node._size);
+				std::fill(slots, slots + table, 0);
+				for (uint32_t m = 0; m < node._size; ++m)
+				{
+					size_t slot = std::hash<std::string_view>()(copy[m].key) & (table - 1);
+					while (slots[slot] != 0)
+						slot = (slot + 1) & (table - 1);
+					slots[slot] = m + 1;
+				}
+			}
+			return node;
+		}
+	public:
+		Builder(Document& doc, const char* data, const uint32_t* first, const uint32_t* last, size_t end) : _doc(doc), _tokens(data, first, last, end) { }
+
+		bool done() const { return _tokens.done(); }
+
+		Node value()
+		{
+			switch (_tokens.peek())
+			{
+			case '\0': throw Error("Unexpected end of data");
+			case '{': return _object();
+			case '[': return _array();
+			case '"': return _string();
+			case '}': case ']': case ':': case ',':
+				throw Error("Not a valid value");
+			default: return _scalar();
+			}
+		}
 	};
 
-	template <class IT, class S>
-	Parser<IT, S> makeParser(IT it, S end) { return { std::move(it), std::move(end) }; }
+	const Document::Node& Document::_parse(const char* data, const uint32_t* first, const uint32_t* last, size_t end)
+	{
+		_arena.clear();
+		_nodes.clear();
+		_members.clear();
+		_root = Node();
+
+		Builder builder(*this, data, first, last, end);
+		_root = builder.value();
+		if (!builder.done())
+			throw Error("Unexpected data after value");
+		return _root;
+	}
 
-	Value parse(std::string_view stored) { return makeParser(stored.begin(), stored.end())(); }
+	const Document::Node& Document::parse(std::string_view source)
+	{
+		std::vector<uint32_t> index;
+		index.reserve(source.size() / 8);
+		Indexer()(source.data(), 0, source.size(), true, index);
+		return _parse(source.data(), index.data(), index.data() + index.size(), source.size());
+	}
+
+	void parseEach(std::istream& in, const std::function<void(const Document::Node&)>& element)
+	{
+		Document document;
+		each(in, [&](const char* data, const uint32_t* first, const uint32_t* last, size_t end)
+		{
+			element(document._parse(data, first, last, end));
+		});
+	}
 }
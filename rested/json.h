@@ -3,17 +3,32 @@
 #include <variant>
 #include <vector>
 #include <string>
+#include <iosfwd>
+#include <tuple>
+#include <memory>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
 
 namespace json
 {
 	class Value;
 
+	// Numbers without a fraction or exponent that fit, kept exact
+	using Integer = long long;
 	using Array = std::vector<Value>;
 	using Object = std::vector<std::pair<std::string, Value>>;
 
 	namespace details
 	{
-		using ValueVariant = std::variant<nullptr_t, bool, double, std::string, Array, Object>;
+		using ValueVariant = std::variant<nullptr_t, bool, Integer, double, std::string, Array, Object>;
+
+		// Whether T lists its members in a static fields() function, as for db::Query::as
+		template <class T, class = void> struct Described : std::false_type { };
+		template <class T> struct Described<T, std::void_t<decltype(T::fields())>> : std::true_type { };
 	}
 
 	class Value : public details::ValueVariant
@@ -23,49 +38,330 @@ namespace json
 	};
 
 	Value parse(std::string_view stored);
+	// Parses an array from the stream, handing over each element as soon as it is complete
+	void parseEach(std::istream& in, const std::function<void(Value&&)>& element);
+
+	// A parsed document kept in one arena: nodes, members and unescaped strings
+	// are carved out of a few large blocks and released together. Strings
+	// without escapes are not copied but point into the source text, which
+	// has to outlive the document. Keys are interned, and objects with many
+	// members carry a hash index for find().
+	class Document
+	{
+		class Builder;
+	public:
+		enum class Type : char { Null, Bool, Integer, Double, String, Array, Object };
+		struct Member;
+
+		template <class T>
+		struct Range
+		{
+			const T* first;
+			const T* last;
+
+			const T* begin() const { return first; }
+			const T* end() const { return last; }
+			size_t size() const { return size_t(last - first); }
+			const T& operator[](size_t i) const { return first[i]; }
+		};
+
+		class Node
+		{
+			friend class Builder;
+
+			// Objects with more members than this are followed by a hash index
+			static constexpr uint32_t indexed = 16;
+
+			Type _type = Type::Null;
+			uint32_t _size = 0;
+			union
+			{
+				bool _boolean;
+				Integer _integer;
+				double _number;
+				const char* _text;
+				const Node* _elements;
+				const Member* _members;
+			};
+
+			void _expect(Type type) const;
+		public:
+			Node() : _integer(0) { }
+
+			Type type() const { return _type; }
+			bool isNull() const { return _type == Type::Null; }
+
+			bool boolean() const { _expect(Type::Bool); return _boolean; }
+			Integer integer() const { _expect(Type::Integer); return _integer; }
+			// Integers too, converted
+			double number() const;
+			std::string_view string() const { _expect(Type::String); return { _text, _size }; }
+			Range<Node> elements() const { _expect(Type::Array); return { _elements, _elements + _size }; }
+			Range<Member> members() const;
+
+			// The value of the first member called key, or null when there is none or this is no object
+			const Node* find(std::string_view key) const;
+
+			// Copies the node into a Value, for code that wants to keep it
+			Value value() const;
+		};
+
+		struct Member
+		{
+			std::string_view key;
+			Node value;
+		};
+	private:
+		class Arena
+		{
+			std::vector<std::unique_ptr<char[]>> _blocks;
+			char* _next = nullptr;
+			size_t _left = 0;
+			size_t _block = 1 << 12;
+		public:
+			void* allocate(size_t size, size_t align);
+			// Starts over in the largest block, freeing the rest
+			void clear();
+		};
+
+		Arena _arena;
+		// Interned keys outlive clear(), so that a document reused for many rows stores each key once
+		Arena _key_arena;
+		std::unordered_set<std::string_view> _keys;
+		std::string _unescaped;
+		// Values collected for the arrays and objects being built
+		std::vector<Node> _nodes;
+		std::vector<Member> _members;
+		Node _root;
 
+		std::string_view _intern(std::string_view key);
+		const Node& _parse(const char* data, const uint32_t* first, const uint32_t* last, size_t end);
+		friend void parseEach(std::istream& in, const std::function<void(const Node&)>& element);
+	public:
+		Document() = default;
+		explicit Document(std::string_view source) { parse(source); }
+		Document(Document&&) = default;
+		Document& operator=(Document&&) = default;
+
+		// Replaces the content of the document, reusing its memory
+		const Node& parse(std::string_view source);
+		const Node& root() const { return _root; }
+	};
+
+	// Like parseEach for Values, with every element built in the same document.
+	// Nodes are only valid during the call that hands them over.
+	void parseEach(std::istream& in, const std::function<void(const Document::Node&)>& element);
+
+	// Receives a document piece by piece as it is parsed, without any tree
+	// being built. Text handed over is only valid during the call.
+	class Handler
+	{
+	public:
+		virtual ~Handler() = default;
+
+		virtual void onNull() = 0;
+		virtual void onBool(bool value) = 0;
+		virtual void onInteger(Integer value) = 0;
+		virtual void onNumber(double value) = 0;
+		virtual void onString(std::string_view text) = 0;
+		virtual void onKey(std::string_view name) = 0;
+		virtual void onBeginArray() = 0;
+		virtual void onEndArray() = 0;
+		virtual void onBeginObject() = 0;
+		virtual void onEndObject() = 0;
+	};
+
+	void parse(std::string_view text, Handler& handler);
+	// Reports the elements of the array in the stream, leaving out the array itself
+	void parseEach(std::istream& in, Handler& handler);
+
+	void append(std::string& out, std::string_view text);
+	void append(std::string& out, long long value);
+	void append(std::string& out, double value);
 
 	std::string stringify(std::string_view text);
 
 	inline std::string stringify(nullptr_t) { return "null"; }
 	inline std::string stringify(bool value) { return value ? "true" : "false"; }
+	inline std::string stringify(Integer value) { std::string result; append(result, value); return result; }
 	inline std::string stringify(const std::string& text) { return stringify(std::string_view{ text }); }
 
 	std::string stringify(double value);
 	std::string stringify(const details::ValueVariant& value);
 
+	// Writes JSON text as it goes into a single buffer, inserting separators
+	// between values. Given a sink, the buffer is handed to it whenever it grows
+	// past a few pages, so output of any length needs no more memory than that.
+	class Writer
+	{
+		std::string _own;
+		std::string& _out;
+		std::ostream* _sink = nullptr;
+		const bool _pretty;
+		size_t _depth = 0;
+		bool _first = true;			// Nothing written yet in the innermost array or object
+		bool _after_key = false;
+
+		void _separate();
+		void _indent();
+		void _spill();
+
+		template <class T, class F>
+		void _field(const T& record, const F& field)
+		{
+			if (field.key.empty())
+				key(field.name);
+			else
+				quotedKey(field.key);
+			value(record.*field.member);
+		}
+	public:
+		explicit Writer(std::string& out, bool pretty = false) : _out(out), _pretty(pretty) { }
+		explicit Writer(std::ostream& sink, bool pretty = false) : _out(_own), _sink(&sink), _pretty(pretty) { }
+		Writer(const Writer&) = delete;
+		~Writer() { flush(); }
+
+		Writer& beginArray();
+		Writer& endArray();
+		Writer& beginObject();
+		Writer& endObject();
+		Writer& key(std::string_view name);
+		// Writes a key that already is quoted and followed by its colon
+		Writer& quotedKey(std::string_view quoted);
+
+		Writer& value(nullptr_t);
+		Writer& value(bool value);
+		Writer& value(double value);
+		Writer& value(long long value);
+		Writer& value(int number) { return value(static_cast<long long>(number)); }
+		Writer& value(std::string_view text);
+		Writer& value(const char* text) { return value(std::string_view(text)); }
+		Writer& value(const std::string& text) { return value(std::string_view(text)); }
+		Writer& value(const details::ValueVariant& value);
+
+		template <class T>
+		Writer& value(const std::vector<T>& array)
+		{
+			beginArray();
+			for (auto&& e : array)
+				value(e);
+			return endArray();
+		}
+		template <class T>
+		Writer& value(const std::vector<std::pair<std::string, T>>& object)
+		{
+			beginObject();
+			for (auto&& e : object)
+				key(e.first).value(e.second);
+			return endObject();
+		}
+
+		template <class T>
+		Writer& value(const std::optional<T>& optional) { return optional ? value(*optional) : value(nullptr); }
+
+		// Structs described by fields() become objects, with the keys given there
+		template <class T, std::enable_if_t<details::Described<T>::value, int> = 0>
+		Writer& value(const T& record)
+		{
+			beginObject();
+			std::apply([&](const auto&... field) { (_field(record, field), ...); }, T::fields());
+			return endObject();
+		}
+
+		// Writes text that already is a JSON value
+		Writer& raw(std::string_view json);
+
+		// Hands everything written so far to the sink
+		void flush();
+	};
 
 	template <class T>
 	std::string stringify(const std::vector<T>& array)
 	{
-		static const auto comma = ", ";
-		auto delim = "";
 		std::string result;
-
-		result.append("[ ");
-		for (auto&& e : array)
-		{
-			result.append(delim).append(stringify(e));
-			delim = comma;
-		}
-		result.append(" ]");
+		Writer(result).value(array);
 		return result;
 	}
 	template <class T>
 	std::string stringify(const std::vector<std::pair<std::string, T>>& object)
 	{
-		static const auto comma = ", ";
-		auto delim = "";
 		std::string result;
+		Writer(result).value(object);
+		return result;
+	}
+	template <class T, std::enable_if_t<details::Described<T>::value, int> = 0>
+	std::string stringify(const T& record)
+	{
+		std::string result;
+		Writer(result).value(record);
+		return result;
+	}
 
-		result.append("{ ");
-		for (auto&& e : object)
+	// Reads a node into the matching C++ type. Structs described by fields()
+	// are read from objects: members they do not list are ignored, and fields
+	// without a member keep their value.
+	inline void read(const Document::Node& node, bool& out) { out = node.boolean(); }
+	inline void read(const Document::Node& node, Integer& out) { out = node.integer(); }
+	inline void read(const Document::Node& node, double& out) { out = node.number(); }
+	inline void read(const Document::Node& node, std::string& out) { out = node.string(); }
+	void read(const Document::Node& node, int& out);
+	template <class T>
+	void read(const Document::Node& node, std::optional<T>& out);
+	template <class T>
+	void read(const Document::Node& node, std::vector<T>& out);
+	template <class T, std::enable_if_t<details::Described<T>::value, int> = 0>
+	void read(const Document::Node& node, T& record);
+
+	template <class T>
+	void read(const Document::Node& node, std::optional<T>& out)
+	{
+		if (node.isNull())
+			out.reset();
+		else
+			read(node, out.emplace());
+	}
+	template <class T>
+	void read(const Document::Node& node, std::vector<T>& out)
+	{
+		out.clear();
+		for (auto& element : node.elements())
+			read(element, out.emplace_back());
+	}
+
+	namespace details
+	{
+		// Reads value into the field at index, if that one is called key
+		template <class T, class Fields, size_t... I>
+		bool readField(const Document::Member& member, T& record, const Fields& fields, size_t index, std::index_sequence<I...>)
 		{
-			result.append(delim).append(stringify(e.first)).append(": ").append(stringify(e.second));
-			delim = comma;
+			return ((I == index && std::get<I>(fields).name == member.key ? (read(member.value, record.*std::get<I>(fields).member), true) : false) || ...);
 		}
-		result.append(" }");
-		return result;
+	}
+
+	template <class T, std::enable_if_t<details::Described<T>::value, int>>
+	void read(const Document::Node& node, T& record)
+	{
+		const auto fields = T::fields();
+		constexpr size_t count = std::tuple_size_v<std::remove_const_t<decltype(fields)>>;
+		// Members mostly come in the order of the fields, as they were written, so
+		// the one after the last match is tried first
+		size_t next = 0;
+		for (auto& member : node.members())
+			for (size_t tried = 0; tried < count; ++tried, next = (next + 1) % count)
+				if (details::readField(member, record, fields, next, std::make_index_sequence<count>{}))
+				{
+					next = (next + 1) % count;
+					break;
+				}
+	}
+
+	template <class T, std::enable_if_t<details::Described<T>::value, int> = 0>
+	T parse(std::string_view text)
+	{
+		const Document document(text);
+		T record;
+		read(document.root(), record);
+		return record;
 	}
 
 }
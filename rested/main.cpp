@@ -2,6 +2,13 @@
 
 #include "server.h"
 #include "database.h"
+#include "cache.h"
+#include "executor.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "backup.h"
+#include "binary.h"
+#include "model.h"
 
 #include "range.h"
 #include "string.h"
@@ -10,6 +17,17 @@
 #include <algorithm>
 #include <cstdint>
 #include <array>
+#include <charconv>
+#include <limits>
+#include <sstream>
+#include <optional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
 
 using namespace db;
 
@@ -27,65 +45,752 @@ static std::ostream& operator<<(std::ostream& out, const std::vector<T>& v)
 	return out << "]";
 }
 
+// Binds the members of each JSON object the parser reports straight to the
+// parameters of a statement for the same columns, found by column name, so
+// that rows go from request bytes to sqlite3_bind_* without a tree between.
+// Statements are prepared once per set of columns; rows with the same columns
+// in another order reuse them. Rows can be collected in batches, so that the
+// statements run together once a batch is complete rather than while the
+// request is still being read.
+class RowBinder : public json::Handler
+{
+public:
+	using Prepare = std::function<Query(const std::vector<std::string_view>& columns)>;
+	// Runs the statement for a row whose columns are bound to parameters 1 to columns
+	using Row = std::function<void(Query& query, size_t columns)>;
+	// Called when a batch is complete; has to call flush()
+	using Full = std::function<void()>;
+private:
+	struct Statement
+	{
+		std::vector<std::string> columns;
+		Query query;
+	};
+	// A member of a row being read; its key and text sit in _text
+	struct Field
+	{
+		size_t key = 0, key_size = 0;
+		int type = 0;
+		int param = 0;
+		sqlite_int64 integer = 0;
+		double real = 0;
+		size_t text = 0, text_size = 0;
+	};
+	// A complete row: its statement and fields
+	struct Pending
+	{
+		size_t statement, first, count;
+	};
+
+	Prepare _prepare;
+	Row _row;
+	const size_t _batch;
+	Full _full;
+	std::vector<Statement> _statements;
+	size_t _current = 0;			// The statement of the last row, likely that of the next
+	size_t _depth = 0;
+	size_t _first = 0;				// The first field of the row being read
+	std::vector<Field> _fields;
+	std::string _text;
+	std::vector<Pending> _pending;
+
+	std::string_view _view(size_t at, size_t size) const { return { _text.data() + at, size }; }
+
+	Field& _field()
+	{
+		if (_depth != 1)
+			throw InvalidRequest(_depth == 0 ? "Expected an object of column values" : "Cannot store json arrays or objects");
+		if (_fields.size() == _first || _fields.back().type != 0)
+			throw std::logic_error("Value without a key");
+		return _fields.back();
+	}
+
+	// Sets the parameter of each field of the row in a statement, or returns
+	// false when its columns differ
+	bool _match(const Statement& statement)
+	{
+		if (statement.columns.size() != _fields.size() - _first)
+			return false;
+		for (size_t f = _first; f < _fields.size(); ++f)
+		{
+			auto key = _view(_fields[f].key, _fields[f].key_size);
+			if (statement.columns[f - _first] == key)
+			{
+				_fields[f].param = int(f - _first) + 1;
+				continue;
+			}
+			auto found = std::find(statement.columns.begin(), statement.columns.end(), key);
+			if (found == statement.columns.end())
+				return false;
+			_fields[f].param = int(found - statement.columns.begin()) + 1;
+		}
+		return true;
+	}
+
+	void _finish()
+	{
+		if (_current >= _statements.size() || !_match(_statements[_current]))
+		{
+			_current = 0;
+			while (_current < _statements.size() && !_match(_statements[_current]))
+				++_current;
+			if (_current == _statements.size())
+			{
+				std::vector<std::string_view> columns;
+				for (size_t f = _first; f < _fields.size(); ++f)
+					columns.push_back(_view(_fields[f].key, _fields[f].key_size));
+				Statement statement{ { columns.begin(), columns.end() }, _prepare(columns) };
+				_statements.push_back(std::move(statement));
+				_match(_statements.back());
+			}
+		}
+
+		_pending.push_back({ _current, _first, _fields.size() - _first });
+		if (_pending.size() < _batch)
+			return;
+		if (_full)
+			_full();
+		else
+			flush();
+	}
+public:
+	RowBinder(Prepare prepare, Row row, size_t batch = 1, Full full = nullptr) : 
+		_prepare(std::move(prepare)), _row(std::move(row)), _batch(batch), _full(std::move(full)) { }
+
+	size_t pending() const { return _pending.size(); }
+
+	// Binds and runs each complete row. Text is bound without a copy, so the
+	// statement has to run within the row callback.
+	void flush()
+	{
+		for (auto& row : _pending)
+		{
+			auto& query = _statements[row.statement].query;
+			for (size_t f = row.first; f < row.first + row.count; ++f)
+			{
+				auto& field = _fields[f];
+				switch (field.type)
+				{
+				case SQLITE_INTEGER: query.bind(field.param, field.integer); break;
+				case SQLITE_FLOAT: query.bind(field.param, field.real); break;
+				case SQLITE_TEXT: query.bind(field.param, _view(field.text, field.text_size)); break;
+				default: query.bind(field.param, nullptr); break;
+				}
+			}
+			_row(query, row.count);
+		}
+		_pending.clear();
+		_fields.clear();
+		_text.clear();
+		_first = 0;
+	}
+
+	void onNull() override { _field().type = SQLITE_NULL; }
+	void onBool(bool value) override { onInteger(value); }
+	void onInteger(json::Integer value) override
+	{
+		auto& field = _field();
+		field.type = SQLITE_INTEGER;
+		field.integer = value;
+	}
+	void onNumber(double value) override
+	{
+		auto& field = _field();
+		field.type = SQLITE_FLOAT;
+		field.real = value;
+	}
+	void onString(std::string_view text) override
+	{
+		auto& field = _field();
+		field.type = SQLITE_TEXT;
+		field.text = _text.size();
+		field.text_size = text.size();
+		_text.append(text);
+	}
+	void onKey(std::string_view name) override
+	{
+		if (_depth != 1)
+			throw InvalidRequest("Cannot store json arrays or objects");
+		Field field;
+		field.key = _text.size();
+		field.key_size = name.size();
+		_fields.push_back(field);
+		_text.append(name);
+	}
+	void onBeginArray() override
+	{
+		throw InvalidRequest(_depth == 0 ? "Expected an object of column values" : "Cannot store json arrays or objects");
+	}
+	void onEndArray() override { }
+	void onBeginObject() override
+	{
+		if (_depth++ != 0)
+			throw InvalidRequest("Cannot store json arrays or objects");
+		_first = _fields.size();
+	}
+	void onEndObject() override
+	{
+		_depth = 0;
+		if (_fields.size() == _first)
+			throw InvalidRequest("Expected at least one column value");
+		_finish();
+		_first = _fields.size();
+	}
+};
+
 class TableLocation : public Location
 {
 	std::shared_ptr<Database> _db;
 	std::string _table;
+	shared<ResultCache> _cache;
+	// The table as the cache knows it, apart from tables of other databases
+	std::string _tag;
+	shared<Executor> _executor;
+	shared<Snapshot> _snapshot;
+
+	// Rows that ?expand=<column> can nest in place of a foreign key
+	struct Expansion
+	{
+		Reference ref;
+		std::vector<std::string> columns;
+	};
+	std::map<std::string, Expansion, std::less<>> _expansions;
+	bool _searchable = false;
 
-	template <class T>
-	static std::enable_if_t<std::is_integral_v<T>, std::string> 
-		intsToString(T value) { return std::to_string(value); }
-	template <class T>
-	static std::enable_if_t<!std::is_integral_v<T>, T>
-		intsToString(T value) { return value; }
+	static constexpr sqlite_int64 max_page = 1000;
 
 	static constexpr struct
 	{
 		using R = db::Value;
 		R operator()(nullptr_t) const { return nullptr; }
 		R operator()(bool v) const { return int(v); }
+		R operator()(json::Integer v) const { return sqlite_int64(v); }
 		R operator()(double v) const { return v; }
 		R operator()(const std::string& v) const { return v; }
 		R operator()(const json::Array& v) const { return json::stringify(v); }
 		R operator()(const json::Object& v) const { return json::stringify(v); }
 	} storeJson{};
 
-	db::Value _store_json(const json::Value& value)
+	db::Value _store_json(const json::Document::Node& value)
+	{
+		using Type = json::Document::Type;
+		switch (value.type())
+		{
+		case Type::Null: return nullptr;
+		case Type::Bool: return int(value.boolean());
+		case Type::Integer: return sqlite_int64(value.integer());
+		case Type::Double: return value.number();
+		case Type::String: return std::string(value.string());
+		default: throw std::runtime_error("Cannot store json arrays or objects");
+		}
+	}
+
+	struct Paging
+	{
+		Order order;
+		std::optional<sqlite_int64> after;
+		std::optional<sqlite_int64> limit;
+		// Id of the last row sent, when the limit cut the result short
+		std::optional<sqlite_int64> next;
+	};
+
+	static sqlite_int64 _parse_count(std::string_view key, std::string_view text)
+	{
+		sqlite_int64 result = 0;
+		if (text.empty() || text.size() > 18)
+			throw InvalidRequest("Invalid value for " + std::string(key));
+		for (auto ch : text)
+			if (isdigit(static_cast<unsigned char>(ch)))
+				result = result * 10 + (ch - '0');
+			else
+				throw InvalidRequest("Invalid value for " + std::string(key));
+		return result;
+	}
+
+	// Reads one CSV record as in RFC 4180; fields that are empty and unquoted come back as null
+	static bool _read_csv(std::istream& in, std::vector<std::optional<std::string>>& record)
+	{
+		record.clear();
+		if (in.peek() == std::istream::traits_type::eof())
+			return false;
+		std::string field;
+		bool quoting = false;
+		bool quoted = false;
+		auto push = [&]
+		{
+			if (field.empty() && !quoted)
+				record.emplace_back();
+			else
+				record.emplace_back(std::move(field));
+			field.clear();
+			quoted = false;
+		};
+		for (int ch; (ch = in.get()) != std::istream::traits_type::eof(); )
+		{
+			if (quoting)
+			{
+				if (ch != '"')
+					field.push_back(char(ch));
+				else if (in.peek() == '"')
+					field.push_back(char(in.get()));
+				else
+					quoting = false;
+				continue;
+			}
+			switch (ch)
+			{
+			case '"': quoting = quoted = true; continue;
+			case ',': push(); continue;
+			case '\r': continue;
+			case '\n': push(); return true;
+			default: field.push_back(char(ch)); continue;
+			}
+		}
+		push();
+		return true;
+	}
+
+	// The binary format the Accept header prefers, or none for JSON. Of the types
+	// we can send, the first one with the highest quality wins
+	static std::optional<binary::Format> _accepted(const Request& request)
+	{
+		auto accept = request.fields.find("Accept");
+		if (accept == request.fields.end())
+			return std::nullopt;
+		std::optional<binary::Format> best;
+		double best_quality = 0;
+		for (auto&& entry : std::string_view(accept->second) | split(","))
+		{
+			std::string_view type;
+			double quality = 1;
+			bool first = true;
+			for (auto part : entry | split(";"))
+			{
+				while (!part.empty() && isspace(part.front()))
+					part.remove_prefix(1);
+				while (!part.empty() && isspace(part.back()))
+					part.remove_suffix(1);
+				if (first)
+					type = part;
+				else if (part.substr(0, 2) == "q=")
+					std::from_chars(part.data() + 2, part.data() + part.size(), quality);
+				first = false;
+			}
+			const auto format = binary::format(type);
+			if (!format && type != "application/json" && type != "application/*" && type != "*/*")
+				continue;
+			if (quality > best_quality)
+			{
+				best_quality = quality;
+				best = format;
+			}
+		}
+		return best;
+	}
+	static std::optional<binary::Format> _content_format(const Request& request)
+	{
+		auto content_type = request.fields.find("Content-Type");
+		return content_type == request.fields.end() ? std::nullopt : binary::format(content_type->second);
+	}
+	static ContentType _content_type(std::optional<binary::Format> format)
+	{
+		if (!format)
+			return ContentType::AppJson;
+		return *format == binary::Format::MessagePack ? ContentType::AppMsgPack : ContentType::AppCbor;
+	}
+	// Responses differ by database and format, so the cache keeps them apart
+	std::string _cache_key(const Request& request, std::optional<binary::Format> format) const
+	{
+		std::ostringstream location;
+		location << _tag << ' ';
+		if (format)
+			location << name(_content_type(format)) << ' ';
+		location << request.location << request.query;
+		return location.str();
+	}
+
+	// GET search?q=<words>&limit=<count>: rows whose indexed text has words
+	// starting with each of the given ones, best matches first
+	void _search(const Request& request, Response& res)
 	{
-		using std::get_if;
-		if (get_if<nullptr_t>(&value))
-			return nullptr;
-		if (auto v = get_if<bool>(&value))
-			return int(*v);
-		if (auto v = get_if<double>(&value))
-			return *v;
-		if (auto v = get_if<std::string>(&value))
-			return *v;
-		throw std::runtime_error("Cannot store json arrays or objects");
+		std::string words;
+		sqlite_int64 limit = 20;
+		for (auto&& kv : request.query)
+		{
+			if (kv.first == "q")
+				words = kv.second;
+			else if (kv.first == "limit")
+				limit = std::clamp<sqlite_int64>(_parse_count(kv.first, kv.second), 1, max_page);
+			else
+				throw InvalidRequest("Search takes only q and limit");
+		}
+
+		// Each word becomes a quoted prefix query, so nothing typed is read as FTS5 syntax
+		std::string match;
+		for (size_t i = 0; i < words.size(); )
+		{
+			auto word = [&](char c) { return isalnum(static_cast<unsigned char>(c)) || static_cast<unsigned char>(c) >= 0x80; };
+			while (i < words.size() && !word(words[i]))
+				++i;
+			const size_t start = i;
+			while (i < words.size() && word(words[i]))
+				++i;
+			if (i > start)
+				match.append(match.empty() ? "\"" : " \"").append(words, start, i - start).append("\"*");
+		}
+		if (match.empty())
+			throw InvalidRequest("Search needs some words in q");
+
+		const auto format = _accepted(request);
+		std::string key;
+		if (_cache)
+		{
+			key = _cache_key(request, format);
+			if (auto hit = _cache->find(key))
+			{
+				res.status = Status::OK;
+				res.contentType = _content_type(format);
+				res.body(std::move(hit.data));
+				return;
+			}
+		}
+		const auto generation = _cache ? _cache->generation(_tag) : 0;
+		auto data = _result(res, _db->search(_table, match, limit), format);
+		if (_cache)
+			_cache->insert(std::move(key), _tag, std::nullopt, std::move(data), {}, generation);
 	}
 
-	void _json_result(Response& res, Query&& q) { _json_result(res, q); }
-	void _json_result(Response& res, Query& q)
+	// Inserts rows from a JSON, MessagePack or CBOR array of objects,
+	// newline-delimited JSON objects or CSV with a header line, reading the
+	// content as it arrives
+	void _import(const Request& request, Response& res)
 	{
+		static constexpr size_t batch_size = 10000;
 		using namespace ranged;
 
-		std::vector<json::Object> data;
+		auto& in = *request.content;
+		std::vector<sqlite_int64> ids;
+
+		auto prepare = [&](const std::vector<std::string_view>& columns)
+		{
+			static const auto allalpha = [](const std::string_view& s) { return !s.empty() && all(s | map(isalpha)); };
+			if (columns.empty() || !all(columns | map(allalpha)))
+				throw InvalidRequest("Invalid column names in imported row");
+			return Query(_db->insert(_table, columns));
+		};
+		// Rows are read into batches and inserted a batch at a time, so that the
+		// writer lock is only held while inserting, never while waiting on the client
+		std::optional<RowBinder> binder;
+		binder.emplace(prepare, [&](Query& q, size_t) { q.exec(); ids.push_back(_db->lastInsert()); }, batch_size, [&]
+		{
+			auto transaction = _db->transaction();
+			binder->flush();
+			transaction.commit();
+		});
+
+		auto content_type = request.fields.find("Content-Type");
+		auto is = [&](std::string_view type)
+		{
+			return content_type != request.fields.end() &&
+				std::string_view(content_type->second).substr(0, type.size()) == type;
+		};
+		in >> std::ws;
+		if (auto format = _content_format(request))
+			binary::parseEach(in, *format, *binder);
+		else if (is("application/json") || (!is("application/x-ndjson") && !is("text/csv") && in.peek() == '['))
+			json::parseEach(in, *binder);
+		else if (is("application/x-ndjson") || (!is("text/csv") && in.peek() == '{'))
+		{
+			for (std::string line; std::getline(in, line); )
+				if (!all(line | map(isspace)))
+					json::parse(line, *binder);
+		}
+		else
+		{
+			std::vector<std::optional<std::string>> record;
+			if (!_read_csv(in, record))
+				throw InvalidRequest("Missing CSV header");
+			const std::vector<std::optional<std::string>> header = record;
 
-		for (auto&& row : q)
+			// Each record goes to the binder as an object of text values
+			while (_read_csv(in, record))
+			{
+				if (record.size() == 1 && !record[0])
+					continue;
+				if (record.size() != header.size())
+					throw InvalidRequest("CSV record has " + std::to_string(record.size()) + " fields, expected " + std::to_string(header.size()));
+				binder->onBeginObject();
+				for (size_t f = 0; f < record.size(); ++f)
+				{
+					binder->onKey(header[f].value_or(""));
+					if (record[f])
+						binder->onString(*record[f]);
+					else
+						binder->onNull();
+				}
+				binder->onEndObject();
+			}
+		}
+		if (binder->pending() != 0)
 		{
-			data.emplace_back();
-			for (auto&& c : row)
-				c.value().visit([&](auto v) { data.back().emplace_back(std::string(c.name()), intsToString(std::move(v))); });
+			auto transaction = _db->transaction();
+			binder->flush();
+			transaction.commit();
 		}
+		std::cout << "imported " << ids.size() << " rows into " << _table << "\n";
 
+		const auto format = _accepted(request);
+		std::string out;
+		if (format)
+		{
+			binary::Writer writer(out, *format);
+			writer.array(ids.size());
+			for (auto&& id : ids)
+				writer.integer(id);
+		}
+		else
+		{
+			out = "[ ";
+			for (auto&& id : ids)
+			{
+				if (out.size() > 2)
+					out.append(", ");
+				json::append(out, static_cast<long long>(id));
+			}
+			out.append(" ]");
+		}
+		res.status = Status::Created;
+		res.contentType = _content_type(format);
+		res.body(std::make_shared<const std::string>(std::move(out)));
+	}
+
+	// A plain value compares equal; a prefix like gt:, in: or between: picks another comparison
+	static Criterium _criterium(std::string key, std::string_view text)
+	{
+		static const std::pair<std::string_view, Comparator> prefixes[] =
+		{
+			{ "eq:", Comparator::Equal },
+			{ "ne:", Comparator::NotEqual },
+			{ "lt:", Comparator::Less },
+			{ "le:", Comparator::LessEqual },
+			{ "gt:", Comparator::Greater },
+			{ "ge:", Comparator::GreaterEqual }
+		};
+		auto starts = [&](std::string_view prefix) 
+		{
+			if (text.substr(0, prefix.size()) != prefix)
+				return false;
+			text.remove_prefix(prefix.size());
+			return true;
+		};
+		// Integers as written by sqlite become integers, so that they compare
+		// equal to integer columns; anything else, like 007, stays text
+		auto literal = [](std::string_view item) -> Value
+		{
+			auto digits = item.substr(!item.empty() && item.front() == '-');
+			if (!digits.empty() && digits.size() <= 18 && all(digits | ranged::map(isdigit)) &&
+				(digits.front() != '0' || item == "0"))
+				return std::stoll(std::string(item));
+			return std::string(item);
+		};
+
+		for (auto&& pc : prefixes)
+			if (starts(pc.first))
+				return compare(std::move(key), pc.second, literal(text));
+		if (starts("in:"))
+		{
+			std::vector<Value> values;
+			for (auto&& item : text | split(","))
+				values.push_back(literal(item));
+			return in(std::move(key), values);
+		}
+		if (starts("between:"))
+		{
+			auto bounds = flatten(text | split(","));
+			if (bounds.size() != 2)
+				throw InvalidRequest("between: takes exactly two values");
+			return between(std::move(key), literal(bounds[0]), literal(bounds[1]));
+		}
+		if (text == "isnull:")
+			return isNull(std::move(key));
+		if (text == "notnull:")
+			return notNull(std::move(key));
+		return equal(std::move(key), literal(text));
+	}
+
+	// Sends the rows as JSON, or in the binary format given. Keys are encoded once,
+	// up front, so that each row only adds its values
+	ResultCache::Buffer _result(Response& res, Query&& q, std::optional<binary::Format> format, Paging* paging = nullptr) { return _result(res, q, format, paging); }
+	ResultCache::Buffer _result(Response& res, Query& q, std::optional<binary::Format> format, Paging* paging = nullptr)
+	{
+		auto cursor = q.cursor();
+		const int count = cursor.size();
+
+		const auto limit = paging && paging->limit ? size_t(*paging->limit) : std::numeric_limits<size_t>::max();
+		int id_column = -1;
+		for (int i = 0; i < count; ++i)
+			if (cursor.name(i) == "id")
+				id_column = i;
+
+		// A member of each row object: one column, or the columns of an expanded
+		// row, which are named "<column>.<name>" and take the place of <column>
+		struct Member
+		{
+			std::string key;
+			int column = -1;
+			std::vector<std::pair<std::string, int>> nested;
+		};
+		std::vector<Member> members;
+		std::map<std::string_view, size_t> expanded;
+		for (int i = 0; i < count; ++i)
+			if (cursor.name(i).find('.') == std::string_view::npos)
+				members.push_back({ std::string(cursor.name(i)), i, {} });
+		for (int i = 0; i < count; ++i)
+		{
+			auto name = cursor.name(i);
+			auto dot = name.find('.');
+			if (dot == std::string_view::npos)
+				continue;
+			auto column = name.substr(0, dot);
+			auto found = expanded.find(column);
+			if (found == expanded.end())
+			{
+				auto member = std::find_if(members.begin(), members.end(), [&](auto& m) { return m.key == column; });
+				if (member == members.end())
+					member = members.insert(members.end(), { std::string(column), -1, {} });
+				member->column = -1;
+				found = expanded.emplace(column, member - members.begin()).first;
+			}
+			std::string key;
+			if (format)
+				binary::Writer(key, *format).string(name.substr(dot + 1));
+			else
+			{
+				key = members[found->second].nested.empty() ? "{ " : ", ";
+				json::append(key, name.substr(dot + 1));
+				key.append(": ");
+			}
+			members[found->second].nested.emplace_back(std::move(key), i);
+		}
+		for (size_t m = 0; m < members.size(); ++m)
+		{
+			std::string key;
+			if (format)
+				binary::Writer(key, *format).string(members[m].key);
+			else
+			{
+				key = m == 0 ? "{ " : ", ";
+				json::append(key, members[m].key);
+				key.append(": ");
+			}
+			members[m].key = std::move(key);
+		}
+
+		std::string out;
+		std::optional<binary::Writer> packed;
+		if (format)
+			packed.emplace(out, *format);
+
+		auto value = [&](int i)
+		{
+			if (packed) switch (cursor.type(i))
+			{
+			case SQLITE_INTEGER: packed->integer(cursor.integer(i)); break;
+			case SQLITE_FLOAT: packed->number(cursor.real(i)); break;
+			case SQLITE_TEXT:  packed->string(cursor.text(i)); break;
+			case SQLITE_NULL:  packed->null(); break;
+			default:
+				throw std::logic_error("Unknown column type encountered");
+			}
+			else switch (cursor.type(i))
+			{
+			case SQLITE_INTEGER: json::append(out, static_cast<long long>(cursor.integer(i))); break;
+			case SQLITE_FLOAT: json::append(out, cursor.real(i)); break;
+			case SQLITE_TEXT:  json::append(out, cursor.text(i)); break;
+			case SQLITE_NULL:  out.append("null"); break;
+			default:
+				throw std::logic_error("Unknown column type encountered");
+			}
+		};
+
+		const size_t start = packed ? packed->beginArray() : 0;
+		if (!packed)
+			out.append("[ ");
+		std::string_view delim = "";
+		size_t rows = 0;
+		sqlite_int64 last_id = 0;
+		while (rows < limit && cursor.next())
+		{
+			if (packed)
+				packed->map(members.size());
+			else
+				out.append(delim);
+			for (auto& member : members)
+			{
+				out.append(member.key);
+				if (member.column >= 0)
+					value(member.column);
+				// A left join without a match leaves every column NULL
+				else if (ranged::all(member.nested | ranged::map([&](auto& kc) { return cursor.isNull(kc.second); })))
+				{
+					if (packed)
+						packed->null();
+					else
+						out.append("null");
+				}
+				else
+				{
+					if (packed)
+						packed->map(member.nested.size());
+					for (auto& kc : member.nested)
+					{
+						out.append(kc.first);
+						value(kc.second);
+					}
+					if (!packed)
+						out.append(" }");
+				}
+			}
+			if (!packed)
+				out.append(members.empty() ? "{ }" : " }");
+			delim = ", ";
+			++rows;
+			if (id_column >= 0)
+				last_id = cursor.integer(id_column);
+		}
+		if (rows == limit && id_column >= 0 && cursor.next())
+			paging->next = last_id;
+		if (packed)
+			packed->endArray(start, rows);
+		else
+			out.append(" ]");
+		std::cout << "sent " << rows << " rows\n";
+
+		auto data = std::make_shared<const std::string>(std::move(out));
 		res.status = Status::OK;
-		res.contentType = ContentType::AppJson;
-		res << json::stringify(data);
-		std::cout << "sent: \n" << res.rdbuf() << "\n";
+		res.contentType = _content_type(format);
+		res.body(data);
+		return data;
 	}
 public:
-	TableLocation(shared<Database> db, std::string table) : 
-		_db(std::move(db)), _table(std::move(table))  { }
+	TableLocation(shared<Database> db, std::string table, shared<ResultCache> cache = nullptr, shared<Executor> executor = nullptr, bool snapshot = false) : 
+		_db(std::move(db)), _table(std::move(table)), _cache(std::move(cache)), _tag(ResultCache::tag(*_db, _table)), _executor(std::move(executor))
+	{
+		if (snapshot)
+			_snapshot = std::make_shared<Snapshot>(_db, _table);
+
+		_searchable = !_db->columns(_table + "_search").empty();
+
+		for (auto& ref : _db->references(_table))
+		{
+			auto columns = _db->columns(ref.table);
+			if (std::find(columns.begin(), columns.end(), ref.to) == columns.end())
+				columns.push_back(ref.to);
+			_expansions.emplace(ref.column, Expansion{ ref, std::move(columns) });
+		}
+	}
+
+	Executor* executor() override { return _executor.get(); }
 
 	void handle(const Request& request, SegmentIterator seg, Response& res) override
 	{
@@ -101,6 +806,15 @@ public:
 
 		auto pop = [](auto&& it) { std::string_view r = *it; ++it; return r; };
 
+		if (_searchable && seg != request.location.end() && *seg == "search" && seg + 1 == request.location.end())
+		{
+			if (request.method == Method::Get)
+				_search(request, res);
+			else
+				res.status = Status::MethodNotAllowed;
+			return;
+		}
+
 		if (seg != request.location.end())
 		{
 			if (isdigit(seg->front()))
@@ -125,37 +839,200 @@ public:
 		{
 		case Method::Get: 
 		{
-			auto query = request.query;
-			if (id != 0) query.emplace_back("id", std::to_string(id));
-			_json_result(res,
-				(columns.empty() ? _db->selectAll() : _db->select(columns))
-				.from(_table).where(query | mapPair(equal)));
+			const auto format = _accepted(request);
+			std::string key;
+			if (_cache)
+			{
+				key = _cache_key(request, format);
+				if (auto hit = _cache->find(key))
+				{
+					res.status = Status::OK;
+					res.contentType = _content_type(format);
+					res.body(std::move(hit.data));
+					if (!hit.link.empty())
+						res.set("Link", std::move(hit.link));
+					return;
+				}
+			}
+			const auto generation = _cache ? _cache->generation(_tag) : 0;
+
+			Paging paging;
+			std::vector<Criterium> criteria;
+			std::vector<const Expansion*> expand;
+			for (auto&& kv : request.query)
+			{
+				if (kv.first == "limit")
+					paging.limit = std::clamp<sqlite_int64>(_parse_count(kv.first, kv.second), 1, max_page);
+				else if (kv.first == "after")
+					paging.after = _parse_count(kv.first, kv.second);
+				else if (kv.first == "order")
+				{
+					std::string_view column = kv.second;
+					paging.order.descending = !column.empty() && column.front() == '-';
+					if (paging.order.descending)
+						column.remove_prefix(1);
+					if (column != "id" && _db->indexedColumns(_table).count(std::string(column)) == 0)
+						throw InvalidRequest("Can only order on indexed columns");
+					paging.order.column = column;
+				}
+				else if (kv.first == "expand")
+				{
+					for (auto&& column : flatten(kv.second | split(",")))
+					{
+						auto found = _expansions.find(column);
+						if (found == _expansions.end())
+							throw InvalidRequest("Cannot expand " + std::string(column) + ", which is no foreign key");
+						expand.push_back(&found->second);
+					}
+				}
+				else
+					criteria.push_back(_criterium(kv.first, kv.second));
+			}
+			if (id != 0) criteria.push_back(equal("id", id));
+
+			if (_snapshot && !format && expand.empty() && !paging.limit && !paging.after && paging.order.column == "id" && !paging.order.descending)
+			{
+				std::string out;
+				if (_snapshot->select(columns, criteria, out))
+				{
+					res.status = Status::OK;
+					res.contentType = ContentType::AppJson;
+					res.body(std::make_shared<const std::string>(std::move(out)));
+					return;
+				}
+			}
+
+			auto selected = columns;
+			if (paging.limit && !selected.empty() && !any(selected | equals(std::string_view("id"))))
+				selected.push_back("id");
+			std::vector<std::string> nested;
+			if (!selected.empty())
+			{
+				for (auto e : expand)
+					for (auto& column : e->columns)
+						nested.push_back(identifier(e->ref.column + "." + column));
+				selected.insert(selected.end(), nested.begin(), nested.end());
+			}
+
+			std::optional<Keyset> after;
+			if (paging.after)
+			{
+				after = Keyset{ nullptr, *paging.after };
+				if (paging.order.column != "id")
+				{
+					Query position = _db->select(std::vector<std::string_view>{ paging.order.column })
+						.from(_table).where({ equal("id", *paging.after) });
+					auto row = position.cursor();
+					if (!row.next())
+						throw InvalidRequest("The row to continue after no longer exists");
+					after->value = std::visit([](auto v) -> Value 
+					{ 
+						if constexpr (std::is_same_v<decltype(v), std::string_view>)
+							return std::string(v);
+						else 
+							return v;
+					}, row.value(0));
+				}
+			}
+			auto from = (selected.empty() ? _db->selectAll() : _db->select(selected)).from(_table);
+			for (auto e : expand)
+				from.leftJoin(e->ref, e->columns);
+			auto data = _result(res,
+				std::move(from).where(criteria)
+				.page(paging.order, after, paging.limit ? std::optional<sqlite_int64>(*paging.limit + 1) : std::nullopt),
+				format, &paging);
+
+			std::string link;
+			if (paging.next)
+			{
+				std::ostringstream next;
+				next << '<' << request.location;
+				char delim = '?';
+				for (auto&& kv : request.query)
+					if (kv.first != "after")
+					{
+						next << delim << kv.first << '=' << escape_http(kv.second);
+						delim = '&';
+					}
+				next << delim << "after=" << *paging.next << ">; rel=\"next\"";
+				link = next.str();
+				res.set("Link", link);
+			}
+
+			// Expanded rows depend on other tables, whose writes would not reach the entry
+			if (_cache && expand.empty())
+				_cache->insert(std::move(key), _tag, id != 0 ? std::optional<sqlite_int64>(id) : std::nullopt, std::move(data), std::move(link), generation);
 			return;
 		}
+		case Method::Post:
+			if (id != 0 || !columns.empty() || !request.query.empty())
+				res.status = Status::MethodNotAllowed;
+			else if (!request.content)
+				throw InvalidRequest("Missing content to import");
+			else
+				_import(request, res);
+			return;
 		case Method::Put:
-			if (id == 0 || columns.empty() || !request.query.empty())
+		case Method::Patch:
+			if (id == 0 || (request.method == Method::Put) == columns.empty() || !request.query.empty())
 				res.status = Status::MethodNotAllowed;
 			else
 			{
-				auto body = json::parse(request.body);
-				std::cout << "want to put '" << request.body << "' into columns " << columns << "\n";
+				std::cout << "want to " << name(request.method) << " '" << request.body << "' into columns " << columns << "\n";
 
-				if (columns.size() != 1)
+				if (request.method == Method::Patch)
 				{
-					res.status = Status::NotImplemented;
+					// Values go from the body straight onto the parameters of the update,
+					// which runs once the whole body has parsed. It runs from flush(), while
+					// the text bound to it is still in the binder.
+					std::vector<std::string> assigned;
+					RowBinder binder([&](const std::vector<std::string_view>& names)
+					{
+						std::vector<Criterium> assignments;
+						for (auto column : names)
+						{
+							if (column.empty() || !allalpha(column))
+								throw InvalidRequest("Invalid column name '" + std::string(column) + "'");
+							assignments.push_back(db::equal(std::string(column), nullptr));
+							assigned.emplace_back(column);
+						}
+						return Query(_db->update(_table).set(assignments).where({ equal("id", id) }));
+					}, [&](Query& q, size_t) { _db->exec(q, _table, assigned); }, std::numeric_limits<size_t>::max());
+					if (auto format = _content_format(request))
+					{
+						std::istringstream body(request.body);
+						binary::parse(body, *format, binder);
+					}
+					else
+						json::parse(request.body, binder);
+					if (binder.pending() != 1)
+						throw InvalidRequest("Expected an object of column values");
+					binder.flush();
+					res.status = Status::OK;
+					break;
 				}
-				else if (auto values = std::get_if<json::Array>(&body))
+
+				const json::Document document(request.body);
+				auto& body = document.root();
+				std::vector<Criterium> assignments;
+				if (body.type() == json::Document::Type::Array)
 				{
-					res.status = Status::NotImplemented;
-				}
-				else 
-				{
-					_db->update(_table)
-						.set({ db::equal(std::string(columns[0]), _store_json(body)) })
-						.where({ equal("id", std::to_string(id)) })
-						.exec();
-					res.status = Status::OK;
+					auto values = body.elements();
+					if (values.size() != columns.size())
+						throw InvalidRequest("PUT needs one value per column");
+					for (auto&& cv : zip(columns, values))
+						assignments.push_back(db::equal(std::string(cv.first), _store_json(cv.second)));
 				}
+				else if (columns.size() == 1)
+					assignments.push_back(db::equal(std::string(columns[0]), _store_json(body)));
+				else
+					throw InvalidRequest("PUT to several columns needs an array of values");
+
+				_db->update(_table)
+					.set(assignments)
+					.where({ equal("id", id) })
+					.exec();
+				res.status = Status::OK;
 			}
 			break;
 		default:
@@ -189,35 +1066,538 @@ public:
 //	}
 //};
 
+class ExecutorStatus : public Location
+{
+	struct Report
+	{
+		long long queued = 0;
+		long long running = 0;
+		long long completed = 0;
+		long long rejected = 0;
+		double mean_wait_ms = 0;
+		double max_wait_ms = 0;
+
+		static auto fields()
+		{
+			return std::make_tuple(
+				DB_FIELD(Report, queued),
+				DB_FIELD(Report, running),
+				DB_FIELD(Report, completed),
+				DB_FIELD(Report, rejected),
+				DB_FIELD(Report, mean_wait_ms),
+				DB_FIELD(Report, max_wait_ms));
+		}
+	};
+
+	shared<Executor> _executor;
+public:
+	ExecutorStatus(shared<Executor> executor) : _executor(std::move(executor)) { }
+
+	void handle(const Request& request, SegmentIterator seg, Response& res) override
+	{
+		if (seg != request.location.end())
+		{
+			res.status = Status::NotFound;
+			return;
+		}
+		if (request.method != Method::Get)
+		{
+			res.status = Status::MethodNotAllowed;
+			return;
+		}
+
+		using ms = std::chrono::duration<double, std::milli>;
+		const auto m = _executor->metrics();
+		const auto started = m.completed + m.running;
+		const auto mean_wait = started ? ms(m.total_wait).count() / started : 0.0;
+
+		res.status = Status::OK;
+		res.contentType = ContentType::AppJson;
+		res << json::stringify(Report
+		{
+			static_cast<long long>(m.queued),
+			static_cast<long long>(m.running),
+			static_cast<long long>(m.completed),
+			static_cast<long long>(m.rejected),
+			mean_wait,
+			ms(m.max_wait).count()
+		});
+	}
+};
+
+// GET /admin/cache: how much the result cache holds and how often it serves
+class CacheStatus : public Location
+{
+	struct Report
+	{
+		long long entries = 0;
+		long long bytes = 0;
+		long long hits = 0;
+		long long misses = 0;
+		long long dropped = 0;
+
+		static auto fields()
+		{
+			return std::make_tuple(
+				DB_FIELD(Report, entries),
+				DB_FIELD(Report, bytes),
+				DB_FIELD(Report, hits),
+				DB_FIELD(Report, misses),
+				DB_FIELD(Report, dropped));
+		}
+	};
+
+	shared<ResultCache> _cache;
+public:
+	CacheStatus(shared<ResultCache> cache) : _cache(std::move(cache)) { }
+
+	void handle(const Request& request, SegmentIterator seg, Response& res) override
+	{
+		if (seg != request.location.end())
+		{
+			res.status = Status::NotFound;
+			return;
+		}
+		if (request.method != Method::Get)
+		{
+			res.status = Status::MethodNotAllowed;
+			return;
+		}
+
+		const auto s = _cache->stats();
+		res.status = Status::OK;
+		res.contentType = ContentType::AppJson;
+		res << json::stringify(Report
+		{
+			static_cast<long long>(s.entries),
+			static_cast<long long>(s.size),
+			static_cast<long long>(s.hits),
+			static_cast<long long>(s.misses),
+			static_cast<long long>(s.dropped)
+		});
+	}
+};
+
+class BackupLocation : public Location
+{
+	// What POST takes, as a JSON object or in the query string
+	struct Options
+	{
+		std::string name;
+		bool compact = false;
+
+		static auto fields() { return std::make_tuple(DB_FIELD(Options, name), DB_FIELD(Options, compact)); }
+	};
+
+	shared<Backup> _backup;
+	std::string _directory;
+
+	static std::string _time(Backup::Clock::time_point point, const char* format)
+	{
+		std::string result(64, '\0');
+		const time_t time = Backup::Clock::to_time_t(point);
+		tm time_tm;
+		gmtime_s(&time_tm, &time);
+		result.resize(strftime(result.data(), result.size(), format, &time_tm));
+		return result;
+	}
+
+	void _report(Response& res)
+	{
+		const auto p = _backup->progress();
+		json::Object report
+		{
+			{ "running", p.running },
+			{ "target", p.target },
+			{ "compact", p.compact },
+			{ "pages", json::Integer(p.total) },
+			{ "remaining", json::Integer(p.remaining) },
+			{ "done", p.total ? double(p.total - p.remaining) / p.total : 0.0 },
+			{ "error", p.error.empty() ? json::Value(nullptr) : json::Value(p.error) },
+		};
+		if (!p.target.empty())
+			report.push_back({ "started", _time(p.started, "%Y-%m-%dT%H:%M:%SZ") });
+		if (!p.target.empty() && !p.running)
+			report.push_back({ "finished", _time(p.finished, "%Y-%m-%dT%H:%M:%SZ") });
+		res.contentType = ContentType::AppJson;
+		res << json::stringify(report);
+	}
+public:
+	BackupLocation(shared<Backup> backup, std::string directory) : _backup(std::move(backup)), _directory(std::move(directory)) { }
+
+	void handle(const Request& request, SegmentIterator seg, Response& res) override
+	{
+		if (seg != request.location.end())
+		{
+			res.status = Status::NotFound;
+			return;
+		}
+		switch (request.method)
+		{
+		case Method::Get:
+			res.status = Status::OK;
+			_report(res);
+			return;
+		case Method::Post:
+		{
+			Options options{ _time(Backup::Clock::now(), "rested-%Y%m%d-%H%M%S") };
+			if (request.content && request.content->peek() != std::istream::traits_type::eof())
+			{
+				const std::string body{ std::istreambuf_iterator<char>(*request.content), std::istreambuf_iterator<char>() };
+				json::read(json::Document(body).root(), options);
+			}
+			for (auto&& kv : request.query)
+			{
+				if (kv.first == "name")
+					options.name = kv.second;
+				else if (kv.first == "compact")
+					options.compact = kv.second != "0" && kv.second != "false";
+				else
+					throw InvalidRequest("Unknown backup option " + std::string(kv.first));
+			}
+			static const auto allowed = [](char c) { return isalnum(c) || c == '-' || c == '_'; };
+			if (options.name.empty() || !ranged::all(options.name | ranged::map(allowed)))
+				throw InvalidRequest("Backup names may only hold letters, digits, '-' and '_'");
+
+			std::filesystem::create_directories(_directory);
+			if (_backup->start(_directory + "/" + options.name + ".db", options.compact))
+				res.status = Status::Accepted;
+			else
+				res.status = Status::Conflict;
+			_report(res);
+			return;
+		}
+		default:
+			res.status = Status::MethodNotAllowed;
+		}
+	}
+};
+
+class QueryStatistics : public Location
+{
+	shared<Database> _db;
+
+	static double _ms(Profiler::Duration d) { return std::chrono::duration<double, std::milli>(d).count(); }
+public:
+	QueryStatistics(shared<Database> db) : _db(std::move(db)) { }
+
+	void handle(const Request& request, SegmentIterator seg, Response& res) override
+	{
+		auto profiler = _db->profiler();
+		if (!profiler)
+		{
+			res.status = Status::NotFound;
+			return;
+		}
+		if (request.method != Method::Get)
+		{
+			res.status = Status::MethodNotAllowed;
+			return;
+		}
+
+		json::Array result;
+		if (seg == request.location.end())
+		{
+			size_t count = 20;
+			auto rank = Profiler::Rank::Total;
+			for (auto&& kv : request.query)
+			{
+				if (kv.first == "top" && !kv.second.empty() && kv.second.size() < 6 && ranged::all(kv.second | ranged::map(isdigit)))
+					count = std::stoul(std::string(kv.second));
+				else if (kv.first == "by" && (kv.second == "total" || kv.second == "p99"))
+					rank = kv.second == "total" ? Profiler::Rank::Total : Profiler::Rank::P99;
+				else
+					throw InvalidRequest("Expected top=<count> and by=total or by=p99");
+			}
+			for (auto& s : profiler->top(count, rank))
+				result.push_back(json::Object
+				{
+					{ "sql", s.sql },
+					{ "runs", json::Integer(s.runs) },
+					{ "total_ms", _ms(s.total) },
+					{ "mean_ms", _ms(s.total) / s.runs },
+					{ "p99_ms", _ms(s.p99) },
+					{ "max_ms", _ms(s.max) },
+					{ "rows", json::Integer(s.rows) },
+					{ "steps", json::Integer(s.steps) },
+				});
+		}
+		else if (*seg == "slow" && seg + 1 == request.location.end())
+		{
+			for (auto& s : profiler->slow())
+			{
+				json::Array plan;
+				for (auto& line : s.plan)
+					plan.push_back(line);
+				result.push_back(json::Object
+				{
+					{ "sql", s.sql },
+					{ "ms", _ms(s.time) },
+					{ "rows", json::Integer(s.rows) },
+					{ "steps", json::Integer(s.steps) },
+					{ "plan", std::move(plan) },
+				});
+			}
+		}
+		else
+		{
+			res.status = Status::NotFound;
+			return;
+		}
+		res.status = Status::OK;
+		res.contentType = ContentType::AppJson;
+		res << json::stringify(result);
+	}
+};
+
+// Runs the index advisor's checks for the filters seen since the last request,
+// so that no other request waits on them, and lists the indexes found missing
+class IndexAdvice : public Location
+{
+	shared<Database> _db;
+public:
+	IndexAdvice(shared<Database> db) : _db(std::move(db)) { }
+
+	void handle(const Request& request, SegmentIterator seg, Response& res) override
+	{
+		auto advisor = _db->advisor();
+		if (!advisor || seg != request.location.end())
+		{
+			res.status = Status::NotFound;
+			return;
+		}
+		if (request.method != Method::Get)
+		{
+			res.status = Status::MethodNotAllowed;
+			return;
+		}
+
+		json::Array result;
+		for (auto& index : advisor->review(*_db))
+		{
+			json::Array columns;
+			for (auto& c : index.columns)
+				columns.push_back(c);
+			result.push_back(json::Object
+			{
+				{ "table", index.table },
+				{ "columns", std::move(columns) },
+				{ "sql", index.sql() },
+			});
+		}
+		res.status = Status::OK;
+		res.contentType = ContentType::AppJson;
+		res << json::stringify(result);
+	}
+};
+
+// Tables and indexes every database of the server starts from
+static void createSchema(Database& db)
+{
+	const auto id = integer("id").primaryKey();
+	const auto name = text("name").notNull();
+	const auto desc = text("desc").notNull("");
+	db.create("places", { id, name, desc }, {}).exec();
+	db.create("groups", { id, name, desc }, {}).exec();
+	db.create("characters", 
+	{ 
+		id, name, desc, integer("group"), integer("place"), 
+		integer("str").notNull(5),
+		integer("dex").notNull(5),
+		integer("nte").notNull(5),
+		integer("emp").notNull(5),
+		integer("ntu").notNull(5)
+	},
+	{
+		foreignKey({ "group" }).references("groups", { "id" }),
+		foreignKey({ "place" }).references("places", { "id" })
+	}).exec();
+	db.create(index("places", { "name" })).exec();
+	db.create(index("characters", { "name" })).exec();
+	db.create(index("characters", { "place" }).covering({ "name" })).exec();
+	db.create(index("characters", { "group" }).covering({ "name" })).exec();
+	db.create(search("places", { "name", "desc" })).exec();
+	db.create(search("characters", { "name", "desc" })).exec();
+
+	// Reading rows as the structs of model.h matches their members to the
+	// columns, so this throws if either has changed without the other
+	Query(db.selectAll().from("places")).as<Place>();
+	Query(db.selectAll().from("characters")).as<Character>();
+}
+
+// Serves /c/<campaign>/<table>/... from a database file of the campaign's own,
+// so that writes to one campaign never wait on another's lock. Files are opened
+// on first use and closed again, least recently used first, once more than
+// capacity are open; requests still running on a closed campaign keep it alive
+// until they finish.
+class CampaignLocation : public Location
+{
+	struct Campaign
+	{
+		std::string name;
+		// Listed as soon as it is asked for, then opened outside the lock
+		std::once_flag opened;
+		shared<Database> db;
+		// Declared after db, so it stops before the database closes
+		std::unique_ptr<Checkpointer> checkpointer;
+		VirtualFolder tables;
+	};
+	using List = std::list<shared<Campaign>>;
+
+	const std::string _directory;
+	const StorageProfile _profile;
+	const size_t _capacity;
+	shared<ResultCache> _cache;
+	shared<Executor> _executor;
+
+	std::mutex _mutex;
+	List _lru;
+	std::unordered_map<std::string, List::iterator> _open;
+	// Closed while in use; handed back out instead of opening the file twice
+	std::unordered_map<std::string, std::weak_ptr<Campaign>> _closing;
+
+	void _open_campaign(Campaign& campaign) const
+	{
+		campaign.db = std::make_shared<Database>((_directory + "/" + campaign.name + ".db").c_str());
+		campaign.db->configure(_profile);
+		campaign.checkpointer = std::make_unique<Checkpointer>(*campaign.db);
+		createSchema(*campaign.db);
+		if (_cache)
+			_cache->watch(*campaign.db);
+		for (auto table : { "places", "groups", "characters" })
+			campaign.tables.addLocation(table, std::make_shared<TableLocation>(campaign.db, table, _cache));
+		std::cout << "opened campaign " << campaign.name << "\n";
+	}
+
+	// Null when the campaign has no file yet and create is false. Requests for
+	// other campaigns go on while one opens; those for the same one wait for it.
+	shared<Campaign> _campaign(const std::string& name, bool create)
+	{
+		auto campaign = _listed(name, create);
+		if (campaign)
+			std::call_once(campaign->opened, [&] { _open_campaign(*campaign); });
+		return campaign;
+	}
+
+	shared<Campaign> _listed(const std::string& name, bool create)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (auto found = _open.find(name); found != _open.end())
+		{
+			_lru.splice(_lru.begin(), _lru, found->second);
+			return *found->second;
+		}
+
+		shared<Campaign> campaign;
+		if (auto closing = _closing.find(name); closing != _closing.end())
+		{
+			campaign = closing->second.lock();
+			_closing.erase(closing);
+		}
+		if (!campaign)
+		{
+			namespace fs = std::filesystem;
+			if (!create && !fs::exists(_directory + "/" + name + ".db"))
+				return nullptr;
+			fs::create_directories(_directory);
+			campaign = std::make_shared<Campaign>();
+			campaign->name = name;
+		}
+
+		_lru.push_front(campaign);
+		_open[name] = _lru.begin();
+		while (_lru.size() > _capacity)
+		{
+			auto& last = _lru.back();
+			std::cout << "closing campaign " << last->name << "\n";
+			_closing[last->name] = last;
+			_open.erase(last->name);
+			_lru.pop_back();
+		}
+		for (auto it = _closing.begin(); it != _closing.end();)
+			it = it->second.expired() ? _closing.erase(it) : std::next(it);
+		return campaign;
+	}
+public:
+	CampaignLocation(std::string directory, StorageProfile profile, size_t capacity, shared<ResultCache> cache = nullptr, shared<Executor> executor = nullptr) :
+		_directory(std::move(directory)), _profile(std::move(profile)), _capacity(std::max<size_t>(capacity, 1)), _cache(std::move(cache)), _executor(std::move(executor)) { }
+
+	Executor* executor() override { return _executor.get(); }
+
+	void handle(const Request& request, SegmentIterator seg, Response& res) override
+	{
+		if (seg == request.location.end())
+		{
+			res.status = Status::NotFound;
+			return;
+		}
+
+		static const auto allowed = [](char c) { return isalnum(c) || c == '-' || c == '_'; };
+		if (seg->empty() || seg->size() > 64 || !ranged::all(*seg | ranged::map(allowed)))
+			throw InvalidRequest("Campaign names may only hold letters, digits, '-' and '_'");
+
+		// Reading never creates a campaign, so mistyped names do not leave files behind
+		const bool create = request.method != Method::Get && request.method != Method::Head;
+		auto campaign = _campaign(*seg, create);
+		if (!campaign)
+		{
+			res.status = Status::NotFound;
+			res << "No campaign " << *seg << "\n";
+			return;
+		}
+		campaign->tables.handle(request, seg + 1, res);
+	}
+};
+
 int main(int argc, char* argv[])
 {
 	using std::make_shared;
 
 	auto db = std::make_shared<Database>("rested.db");
+	std::unique_ptr<Checkpointer> checkpointer;
 
 	try
 	{
-		const auto id = integer("id").primaryKey();
-		const auto name = text("name").notNull();
-		const auto desc = text("desc").notNull("");
-		Query(db->create("places", { id, name, desc }, {}));
-		Query(db->create("groups", { id, name, desc }, {}));
-		Query(db->create("charactes", 
-		{ 
-			id, name, desc, integer("group"), integer("place"), 
-			integer("str").notNull(5),
-			integer("dex").notNull(5),
-			integer("nte").notNull(5),
-			integer("emp").notNull(5),
-			integer("ntu").notNull(5)
-		},
-		{
-			foreignKey({ "group" }).references("groups", { "id" }),
-			foreignKey({ "place" }).references("places", { "id" })
-		}));
-
-		serverRoot.addLocation("places", make_shared<TableLocation>(db, "places"));
-		serverRoot.addLocation("characters", make_shared<TableLocation>(db, "characters"));
+		// rested [storage profile] [--profile=<ms>]; statements are only traced
+		// when asked to, as tracing costs a callback for every row stepped
+		std::string_view profile_name = "balanced";
+		std::optional<std::chrono::milliseconds> slow;
+		for (int a = 1; a < argc; ++a)
+		{
+			std::string_view arg = argv[a];
+			if (arg.substr(0, 10) == "--profile=")
+				slow = std::chrono::milliseconds(std::stoi(std::string(arg.substr(10))));
+			else if (arg == "--profile")
+				slow = std::chrono::milliseconds(50);
+			else
+				profile_name = arg;
+		}
+		const auto profile = StorageProfile::named(profile_name);
+		db->configure(profile);
+		checkpointer = std::make_unique<Checkpointer>(*db);
+
+		createSchema(*db);
+		db->adviseIndexes(false);
+		if (slow)
+			db->profile(*slow);
+
+		auto cache = make_shared<ResultCache>(64 << 20);
+		cache->watch(*db);
+
+		auto executor = make_shared<Executor>(4, 1024);
+
+		serverRoot.addLocation("places", make_shared<TableLocation>(db, "places", cache, executor, true));
+		serverRoot.addLocation("groups", make_shared<TableLocation>(db, "groups", cache, executor, true));
+		serverRoot.addLocation("characters", make_shared<TableLocation>(db, "characters", cache, executor));
+		serverRoot.addLocation("c", make_shared<CampaignLocation>("campaigns", profile, 16, cache, executor));
+
+		auto admin = make_shared<VirtualFolder>();
+		admin->addLocation("executor", make_shared<ExecutorStatus>(executor));
+		admin->addLocation("cache", make_shared<CacheStatus>(cache));
+		admin->addLocation("backup", make_shared<BackupLocation>(make_shared<Backup>(db), "backups"));
+		admin->addLocation("queries", make_shared<QueryStatistics>(db));
+		admin->addLocation("indexes", make_shared<IndexAdvice>(db));
+		serverRoot.addLocation("admin", admin);
 		serverRoot.addLocation("interface", make_shared<Folder>("interface"));
 	}
 	catch (std::exception& e)
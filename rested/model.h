@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <optional>
+
+#include "json.h"
+#include "database.h"
+
+// Rows of the tables created in main, for reading them with Query::as and
+// writing or reading them as JSON
+
+struct Place
+{
+	sqlite_int64 id = 0;
+	std::string name;
+	std::string desc;
+
+	static auto fields()
+	{
+		return std::make_tuple(
+			DB_FIELD(Place, id),
+			DB_FIELD(Place, name),
+			DB_FIELD(Place, desc));
+	}
+};
+
+struct Character
+{
+	sqlite_int64 id = 0;
+	std::string name;
+	std::string desc;
+	std::optional<sqlite_int64> group;
+	std::optional<sqlite_int64> place;
+	int str = 5;
+	int dex = 5;
+	int nte = 5;
+	int emp = 5;
+	int ntu = 5;
+
+	static auto fields()
+	{
+		return std::make_tuple(
+			DB_FIELD(Character, id),
+			DB_FIELD(Character, name),
+			DB_FIELD(Character, desc),
+			DB_FIELD(Character, group),
+			DB_FIELD(Character, place),
+			DB_FIELD(Character, str),
+			DB_FIELD(Character, dex),
+			DB_FIELD(Character, nte),
+			DB_FIELD(Character, emp),
+			DB_FIELD(Character, ntu));
+	}
+};
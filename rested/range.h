@@ -171,7 +171,7 @@ namespace ranged
 		{
 			static constexpr std::string_view _empty{};
 			std::string _delim;
-			bool _first;
+			bool _first = true;
 		public:
 			Delimiterator(std::string delim) : _delim(std::move(delim)) { }
 
@@ -1,6 +1,7 @@
 #include "server.h"
 
 #include "range.h"
+#include "executor.h"
 
 #include <ctime>
 #include <thread>
@@ -100,7 +101,7 @@ std::string unescape_http(std::string_view escaped)
 				(ch >= '0' && ch <= '9') ||
 				(ch >= 'A' && ch <= 'Z') ||
 				(ch >= 'a' && ch <= 'z') ||
-				ch == '-' || ch == '.' || ch == '~' || ch == '_' || ch == ',';
+				ch == '-' || ch == '.' || ch == '~' || ch == '_' || ch == ',' || ch == ':';
 		}
 	};
 	static constexpr auto valid_byte = Bitset<256>::fromPredicate(http::is_valid);
@@ -125,6 +126,21 @@ std::string unescape_http(std::string_view escaped)
 	return result;
 }
 
+std::string escape_http(std::string_view text)
+{
+	static constexpr char hex[] = "0123456789ABCDEF";
+	std::string result;
+	result.reserve(text.size());
+	for (auto ch : text)
+	{
+		if (isalnum(static_cast<unsigned char>(ch)) || ch == '-' || ch == '.' || ch == '~' || ch == '_' || ch == ',')
+			result.push_back(ch);
+		else
+			result.append({ '%', hex[static_cast<unsigned char>(ch) >> 4], hex[ch & 0xf] });
+	}
+	return result;
+}
+
 UriQuery parseQueryText(std::string_view query)
 {
 	UriQuery result;
@@ -209,6 +225,7 @@ Method getMethod(tcp::iostream& stream)
 	case 'P':
 		if (token == "POST") return Method::Post;
 		if (token == "PUT")  return Method::Put;
+		if (token == "PATCH") return Method::Patch;
 		break;
 	default: break;
 	}
@@ -248,7 +265,13 @@ Request::Request(tcp::iostream & stream)
 			throw InvalidRequest("Chencked transfer not supported");
 		return;
 	}
-	body.resize(std::stoi(content_length->second));
+	const auto length = size_t(std::stoull(content_length->second));
+	if (method == Method::Post)
+	{
+		content = std::make_unique<RequestBody>(stream, length);
+		return;
+	}
+	body.resize(length);
 	stream.read(body.data(), body.size());
 }
 
@@ -266,7 +289,7 @@ std::string current_time()
 void Response::send(tcp::iostream & stream)
 {
 	_buf.seekg(0, std::ios::end);
-	auto content_length = size_t(_buf.tellg());
+	auto content_length = _body ? _body->size() : size_t(_buf.tellg());
 	_buf.seekg(0, std::ios::beg);
 
 	stream << "HTTP/1.1" << SP << code(status) << SP << name(status) << CRLF;
@@ -278,28 +301,68 @@ void Response::send(tcp::iostream & stream)
 	if (content_length > 0)
 	{
 		stream << "Content-Language: en" << CRLF;
-		stream << "Content-Type: " << name(contentType) << "; charset=" << name(charset) << CRLF;
+		stream << "Content-Type: " << name(contentType);
+		if (!isBinary(contentType))
+			stream << "; charset=" << name(charset);
+		stream << CRLF;
 		stream << "Content-Length: " << content_length << CRLF;
 	}
 	stream << CRLF;
-	stream << _buf.rdbuf();
+	if (_body)
+		stream.write(_body->data(), _body->size());
+	else if (content_length > 0)
+		stream << _buf.rdbuf();
 }
 
 VirtualFolder serverRoot;
 
+std::unique_ptr<asio::io_service> g_io;
+
 class ClientHandler
 {
+	struct Exchange
+	{
+		std::shared_ptr<tcp::iostream> stream;
+		std::unique_ptr<Request> request;
+		Response response;
+	};
 	std::shared_ptr<tcp::iostream> _stream;
+
+	template <class F>
+	static void _guard(Response& response, F&& f)
+	{
+		try
+		{
+			f();
+		}
+		catch (InvalidRequest& invalid)
+		{
+			response.status = Status::BadRequest;
+			response  << "Invalid request: " << invalid.what() << "\n";
+			std::cout << "Invalid request: " << invalid.what() << "\n";
+		}
+		catch (std::exception& e)
+		{
+			response.status = Status::InternalError;
+			std::cout << "Exception while handling request: " << e.what() << "\n";
+		}
+	}
 public:
 	ClientHandler(std::shared_ptr<tcp::iostream> stream) : _stream(std::move(stream)) { }
 
 	void operator()()
 	{
 		using namespace ranged;
-		Response response;
-		try
+		auto exchange = std::make_shared<Exchange>();
+		exchange->stream = _stream;
+		auto& response = exchange->response;
+
+		Location* location = nullptr;
+		SegmentIterator seg;
+		_guard(response, [&]
 		{
-			Request request(*_stream);
+			exchange->request = std::make_unique<Request>(*_stream);
+			auto& request = *exchange->request;
 
 			std::cout << name(request.method) << SP << request.location << "\n";
 			if (!request.query.empty())
@@ -309,18 +372,25 @@ public:
 					std::cout << kvd.second << kvd.first.first << '=' << kvd.first.second;
 			}
 
-			serverRoot.handle(request, request.location.begin(), response);
-		}
-		catch (InvalidRequest& invalid)
-		{
-			response.status = Status::BadRequest;
-			response  << "Invalid request: " << invalid.what() << "\n";
-			std::cout << "Invalid request: " << invalid.what() << "\n";
-		}
-		catch (std::exception& e)
+			std::tie(location, seg) = serverRoot.route(request, request.location.begin());
+		});
+
+		if (location)
 		{
-			response.status = Status::InternalError;
-			std::cout << "Exception while handling request: " << e.what() << "\n";
+			if (auto executor = location->executor())
+			{
+				auto job = [exchange, location, seg]
+				{
+					_guard(exchange->response, [&] { location->handle(*exchange->request, seg, exchange->response); });
+					g_io->post([exchange] { exchange->response.send(*exchange->stream); });
+				};
+				if (executor->submit(_stream.get(), std::move(job)))
+					return;
+				response.status = Status::ServiceUnavailable;
+				response.set("Retry-After", "1");
+			}
+			else
+				_guard(response, [&] { location->handle(*exchange->request, seg, response); });
 		}
 		response.send(*_stream);
 	}
@@ -348,8 +418,6 @@ public:
 	}
 };
 
-std::unique_ptr<asio::io_service> g_io;
-
 static void handle_termination(int)
 {
 	std::cout << "trying to terminate gracefully\n";
@@ -390,6 +458,17 @@ void runServer(size_t thread_count)
 
 
 
+std::pair<Location*, SegmentIterator> VirtualFolder::route(const Request& request, SegmentIterator seg)
+{
+	if (seg != request.location.end())
+	{
+		auto found = _dir.find(*seg);
+		if (found != _dir.end())
+			return found->second->route(request, seg + 1);
+	}
+	return { this, seg };
+}
+
 void VirtualFolder::handle(const Request & request, SegmentIterator seg, Response& res)
 {
 	if (seg != request.location.end())
@@ -423,7 +502,7 @@ namespace std
 {
 	namespace fs
 	{
-		using namespace std::experimental::filesystem;
+		using namespace std::filesystem;
 	}
 }
 
@@ -4,6 +4,7 @@
 #include <map>
 #include <string>
 #include <sstream>
+#include <algorithm>
 #include <string_view>
 
 #include "pointers.h"
@@ -21,10 +22,10 @@ static constexpr char SP = ' ';
 template <class E, class U = std::underlying_type_t<E>>
 U code(E e) { return static_cast<U>(e); }
 
-enum class Method : char { Get, Head, Post, Put, Delete, Connect, Options, Trace };
+enum class Method : char { Get, Head, Post, Put, Delete, Connect, Options, Trace, Patch };
 inline std::string_view name(Method m)
 {
-	static const std::string_view names[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE" };
+	static const std::string_view names[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH" };
 	return names[code(m)];
 }
 
@@ -35,20 +36,22 @@ inline std::string_view name(Charset cs)
 	return names[code(cs)];
 }
 
-enum class ContentType { TextPlain, TextHtml, TextCss, AppJson };
+enum class ContentType { TextPlain, TextHtml, TextCss, AppJson, AppMsgPack, AppCbor };
 inline std::string_view name(ContentType ct)
 {
-	static const std::string_view names[] = { "text/plain", "text/html", "text/css", "application/json" };
+	static const std::string_view names[] = { "text/plain", "text/html", "text/css", "application/json", "application/msgpack", "application/cbor" };
 	return names[code(ct)];
 }
+inline bool isBinary(ContentType ct) { return ct == ContentType::AppMsgPack || ct == ContentType::AppCbor; }
 
 enum class Status : char
 {
 	// 100, 101
-	OK, // 201...
+	OK, Created, Accepted, // 203...
 	Found,	// 300...
 		BadRequest, Unauthorized, Forbidden, NotFound, MethodNotAllowed, // 406...
-		InternalError, NotImplemented, VersionNotSupported
+		Conflict, // 410...
+		InternalError, NotImplemented, ServiceUnavailable, VersionNotSupported
 };
 
 inline auto& data(Status s)
@@ -61,14 +64,18 @@ inline auto& data(Status s)
 	static const StatusData _data[] =
 	{
 		{ 200, "OK" },
+		{ 201, "Created" },
+		{ 202, "Accepted" },
 		{ 302, "Found "},
 		{ 400, "Bad Request" },
 		{ 401, "Unauthorized" },
 		{ 403, "Forbidden" },
 		{ 404, "NotFound" },
 		{ 405, "Method Not Allowed" },
+		{ 409, "Conflict" },
 		{ 500, "Internal Server Error" },
 		{ 501, "Not Implemented" },
+		{ 503, "Service Unavailable" },
 		{ 505, "HTTP Version Not Supported" }
 	};
 	return _data[static_cast<char>(s)];
@@ -110,8 +117,37 @@ inline std::ostream& operator<<(std::ostream& out, const UriQuery& query)
 	return out;
 }
 UriQuery parseQueryText(std::string_view query);
+std::string escape_http(std::string_view text);
 
 
+// Stream over the content of a request, read from the connection as it is consumed
+class RequestBody : public std::istream
+{
+	class Buffer : public std::streambuf
+	{
+		std::streambuf* _source;
+		size_t _remaining;
+		char _data[1 << 12];
+	protected:
+		int_type underflow() override
+		{
+			if (_remaining == 0)
+				return traits_type::eof();
+			auto count = size_t(_source->sgetn(_data, std::streamsize(std::min(_remaining, sizeof(_data)))));
+			if (count == 0)
+				return traits_type::eof();
+			_remaining -= count;
+			setg(_data, _data, _data + count);
+			return traits_type::to_int_type(_data[0]);
+		}
+	public:
+		Buffer(std::streambuf* source, size_t length) : _source(source), _remaining(length) { }
+	};
+	Buffer _buffer;
+public:
+	RequestBody(std::istream& source, size_t length) : std::istream(nullptr), _buffer(source.rdbuf(), length) { rdbuf(&_buffer); }
+};
+
 class Request
 {
 	using tcp = asio::ip::tcp;
@@ -120,6 +156,8 @@ public:
 	UriPath location;
 	UriQuery query;
 	std::string body;
+	// POST content is left on the connection to be streamed, instead of read into body
+	std::unique_ptr<RequestBody> content;
 	std::map<std::string, std::string> fields;
 
 	Request(tcp::iostream& stream);
@@ -129,6 +167,7 @@ class Response
 {
 	using tcp = asio::ip::tcp;
 	std::stringstream _buf;
+	shared<const std::string> _body;
 	std::vector<std::pair<std::string, std::string>> _fields;
 public:
 
@@ -139,6 +178,9 @@ public:
 	auto rdbuf() const { return _buf.rdbuf(); }
 	template <class Arg>
 	Response& operator<<(Arg&& arg) { _buf << std::forward<Arg>(arg); return *this; }
+	Response& write(std::string_view data) { _buf.write(data.data(), data.size()); return *this; }
+	// Sends data as the whole body, without copying it, in place of anything streamed in
+	void body(shared<const std::string> data) { _body = std::move(data); }
 
 	void set(std::string field, std::string value) { _fields.emplace_back(std::move(field), std::move(value)); }
 
@@ -146,6 +188,8 @@ public:
 };
 
 using SegmentIterator = UriPath::const_iterator;
+class Executor;
+
 class Location
 {
 protected:
@@ -155,6 +199,11 @@ public:
 
 	virtual ~Location() = default;
 
+	// The location that will handle the rest of the path, and where that rest starts
+	virtual std::pair<Location*, SegmentIterator> route(const Request&, SegmentIterator seg) { return { this, seg }; }
+	// Where to run handle(), when it should not run on a network thread
+	virtual Executor* executor() { return nullptr; }
+
 	virtual void handle(const Request&, SegmentIterator, Response&) = 0;
 };
 
@@ -176,6 +225,7 @@ public:
 	{
 		_dir.emplace(std::move(name), std::move(loc));
 	}
+	std::pair<Location*, SegmentIterator> route(const Request&, SegmentIterator seg) override;
 	void handle(const Request&, SegmentIterator, Response&) override;
 };
 
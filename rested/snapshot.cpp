@@ -0,0 +1,380 @@
+#include "snapshot.h"
+
+#include "json.h"
+
+#include <limits>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace db;
+
+namespace
+{
+	using Word = uint64_t;
+	constexpr size_t word_bits = 64;
+
+	// More pending rows than this and rereading the whole table is cheaper
+	constexpr size_t max_pending = 1024;
+
+	unsigned lowest_bit(Word word)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, word);
+		return index;
+#else
+		return unsigned(__builtin_ctzll(word));
+#endif
+	}
+
+	bool test(const std::vector<Word>& bits, size_t i) { return (bits[i / word_bits] >> (i % word_bits)) & 1; }
+	void set(std::vector<Word>& bits, size_t i, bool on)
+	{
+		const auto mask = Word(1) << (i % word_bits);
+		if (on)
+			bits[i / word_bits] |= mask;
+		else
+			bits[i / word_bits] &= ~mask;
+	}
+
+	// Clears the bits of all rows whose value differs. The loop is branch free so
+	// that compilers vectorize it; 64 bit integers compare four at a time with AVX2
+	template <class T>
+	void keep_equal(const std::vector<T>& values, T value, std::vector<Word>& bits)
+	{
+		const size_t count = values.size();
+		for (size_t w = 0, base = 0; base < count; ++w, base += word_bits)
+		{
+			const size_t n = std::min(word_bits, count - base);
+			const T* v = values.data() + base;
+			Word mask = 0;
+			size_t i = 0;
+#ifdef __AVX2__
+			if constexpr (std::is_same_v<T, sqlite_int64>)
+			{
+				const __m256i wanted = _mm256_set1_epi64x(value);
+				for (; i + 4 <= n; i += 4)
+				{
+					const __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i)), wanted);
+					mask |= Word(_mm256_movemask_pd(_mm256_castsi256_pd(eq))) << i;
+				}
+			}
+#endif
+			for (; i < n; ++i)
+				mask |= Word(v[i] == value) << i;
+			bits[w] &= mask;
+		}
+	}
+
+	Snapshot::Kind affinity(std::string type)
+	{
+		// The rules SQLite uses to give a declared column type its affinity
+		for (auto& ch : type)
+			ch = char(toupper(ch));
+		auto has = [&](const char* part) { return type.find(part) != std::string::npos; };
+		if (has("INT"))
+			return Snapshot::Kind::Integer;
+		if (has("CHAR") || has("CLOB") || has("TEXT"))
+			return Snapshot::Kind::Text;
+		if (has("REAL") || has("FLOA") || has("DOUB"))
+			return Snapshot::Kind::Real;
+		return Snapshot::Kind::Other;
+	}
+}
+
+Snapshot::Snapshot(shared<Database> db, std::string table) : _db(std::move(db)), _table(std::move(table))
+{
+	_db->onChange([this](const Change& change)
+	{
+		if (change.table != _table)
+			return;
+		std::lock_guard<std::mutex> lock(_pending_mutex);
+		if (change.rowid && _pending.size() < max_pending)
+			_pending.insert(*change.rowid);
+		else
+			_stale = true;
+	});
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_reload();
+}
+
+void Snapshot::_reload()
+{
+	{
+		std::lock_guard<std::mutex> lock(_pending_mutex);
+		_pending.clear();
+		_stale = false;
+	}
+
+	_columns.clear();
+	_rowids.clear();
+	_live.clear();
+	_slots.clear();
+	_dead = 0;
+	_garbage = 0;
+
+	Query info = _db->query("SELECT name, type FROM pragma_table_info(?) ORDER BY cid");
+	info.bind(1, _table);
+	for (auto& row : info.cursor())
+	{
+		Column column;
+		column.name = row.text(0);
+		json::append(column.key, column.name);
+		column.key.append(": ");
+		column.kind = affinity(std::string(row.text(1)));
+		// Without an affinity, SQL compares values exactly as they were stored
+		column.mixed = column.kind == Kind::Other;
+		_columns.push_back(std::move(column));
+	}
+
+	Query all = _db->query("SELECT rowid, * FROM " + identifier(_table) + " ORDER BY rowid");
+	for (auto& row : all.cursor())
+		_store(_append(row.integer(0)), row);
+
+	std::cout << "snapshot of " << _table << ": " << _rowids.size() << " rows\n";
+}
+
+void Snapshot::_refresh()
+{
+	std::set<sqlite_int64> pending;
+	bool stale;
+	{
+		std::lock_guard<std::mutex> lock(_pending_mutex);
+		stale = _stale;
+		pending.swap(_pending);
+	}
+	if (stale)
+		return _reload();
+	if (pending.empty())
+		return;
+
+	Query reread = _db->query("SELECT rowid, * FROM " + identifier(_table) + " WHERE rowid = ?");
+	for (auto rowid : pending)
+	{
+		reread.bind(1, rowid);
+		auto row = reread.cursor();
+		auto slot = _slots.find(rowid);
+		if (row.next())
+		{
+			if (slot != _slots.end())
+				_store(slot->second, row);
+			else if (_rowids.empty() || rowid > _rowids.back())
+				_store(_append(rowid), row);
+			else
+				// Rows stay in rowid order, so one landing in the middle means starting over
+				return _reload();
+		}
+		else if (slot != _slots.end())
+		{
+			for (auto& column : _columns)
+				if (column.kind == Kind::Text)
+					_garbage += column.lengths[slot->second];
+			set(_live, slot->second, false);
+			_slots.erase(slot);
+			++_dead;
+		}
+	}
+
+	size_t arena = 0;
+	for (auto& column : _columns)
+		arena += column.arena.size();
+	if (_dead > _slots.size() || _garbage > arena / 2)
+		_reload();
+}
+
+size_t Snapshot::_append(sqlite_int64 rowid)
+{
+	const size_t slot = _rowids.size();
+	_rowids.push_back(rowid);
+	if (slot % word_bits == 0)
+		_live.push_back(0);
+	set(_live, slot, true);
+	_slots[rowid] = slot;
+
+	for (auto& column : _columns)
+	{
+		if (slot % word_bits == 0)
+			column.nulls.push_back(0);
+		switch (column.kind)
+		{
+		case Kind::Integer: column.integers.push_back(0); break;
+		case Kind::Real: column.reals.push_back(0); break;
+		case Kind::Text:
+			column.offsets.push_back(0);
+			column.lengths.push_back(0);
+			break;
+		case Kind::Other: break;
+		}
+	}
+	return slot;
+}
+
+void Snapshot::_store(size_t slot, const Cursor& row)
+{
+	for (size_t c = 0; c < _columns.size(); ++c)
+	{
+		auto& column = _columns[c];
+		const int i = int(c) + 1;
+		const int type = row.type(i);
+		set(column.nulls, slot, type == SQLITE_NULL);
+
+		switch (column.kind)
+		{
+		case Kind::Integer:
+			if (type == SQLITE_INTEGER)
+				column.integers[slot] = row.integer(i);
+			else if (type != SQLITE_NULL)
+				column.mixed = true;
+			break;
+		case Kind::Real:
+			if (type == SQLITE_FLOAT)
+				column.reals[slot] = row.real(i);
+			else if (type != SQLITE_NULL)
+				column.mixed = true;
+			break;
+		case Kind::Text:
+		{
+			_garbage += column.lengths[slot];
+			column.lengths[slot] = 0;
+			if (type == SQLITE_TEXT)
+			{
+				auto text = row.text(i);
+				if (column.arena.size() + text.size() > std::numeric_limits<uint32_t>::max())
+					column.mixed = true;
+				else
+				{
+					column.offsets[slot] = uint32_t(column.arena.size());
+					column.lengths[slot] = uint32_t(text.size());
+					column.arena.append(text);
+				}
+			}
+			else if (type != SQLITE_NULL)
+				column.mixed = true;
+			break;
+		}
+		case Kind::Other: break;
+		}
+	}
+}
+
+const Snapshot::Column* Snapshot::_column(std::string_view name) const
+{
+	for (auto& column : _columns)
+		if (column.name == name)
+			return column.mixed ? nullptr : &column;
+	return nullptr;
+}
+
+bool Snapshot::select(const std::vector<std::string_view>& names, const std::vector<Criterium>& criteria, std::string& out)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_refresh();
+
+	std::vector<const Column*> selected;
+	if (names.empty())
+	{
+		for (auto& column : _columns)
+			if (column.mixed)
+				return false;
+			else
+				selected.push_back(&column);
+	}
+	for (auto name : names)
+		if (auto column = _column(name))
+			selected.push_back(column);
+		else
+			return false;
+	if (selected.empty())
+		return false;
+
+	auto bits = _live;
+	for (auto& criterium : criteria)
+	{
+		auto column = _column(criterium.key);
+		if (!column || criterium.cmp != Comparator::Equal)
+			return false;
+
+		auto integer = std::get_if<sqlite_int64>(&criterium.value);
+		auto real = std::get_if<double>(&criterium.value);
+		auto text = std::get_if<std::string>(&criterium.value);
+		switch (column->kind)
+		{
+		case Kind::Integer:
+			if (!integer)
+				return false;
+			keep_equal(column->integers, *integer, bits);
+			break;
+		case Kind::Real:
+			if (!integer && !real)
+				return false;
+			keep_equal(column->reals, real ? *real : double(*integer), bits);
+			break;
+		case Kind::Text:
+		{
+			// The column's affinity turns a number into text before comparing
+			std::string number;
+			if (integer)
+				json::append(number, static_cast<long long>(*integer));
+			else if (!text)
+				return false;
+			std::string_view wanted = text ? std::string_view(*text) : std::string_view(number);
+
+			keep_equal(column->lengths, uint32_t(std::min<size_t>(wanted.size(), std::numeric_limits<uint32_t>::max())), bits);
+			for (size_t w = 0; w < bits.size(); ++w)
+				for (Word word = bits[w]; word; word &= word - 1)
+				{
+					const size_t slot = w * word_bits + lowest_bit(word);
+					if (std::string_view(column->arena.data() + column->offsets[slot], wanted.size()) != wanted)
+						set(bits, slot, false);
+				}
+			break;
+		}
+		case Kind::Other:
+			return false;
+		}
+		// Nulls are stored as zeroes and never equal anything
+		for (size_t w = 0; w < bits.size(); ++w)
+			bits[w] &= ~column->nulls[w];
+	}
+
+	size_t rows = 0;
+	out.append("[ ");
+	for (size_t w = 0; w < bits.size(); ++w)
+		for (Word word = bits[w]; word; word &= word - 1)
+		{
+			const size_t slot = w * word_bits + lowest_bit(word);
+			out.append(rows++ == 0 ? "{ " : ", { ");
+			for (size_t c = 0; c < selected.size(); ++c)
+			{
+				auto& column = *selected[c];
+				if (c != 0)
+					out.append(", ");
+				out.append(column.key);
+				if (test(column.nulls, slot))
+				{
+					out.append("null");
+					continue;
+				}
+				switch (column.kind)
+				{
+				case Kind::Integer: json::append(out, static_cast<long long>(column.integers[slot])); break;
+				case Kind::Real: json::append(out, column.reals[slot]); break;
+				case Kind::Text: json::append(out, std::string_view(column.arena.data() + column.offsets[slot], column.lengths[slot])); break;
+				case Kind::Other: break;
+				}
+			}
+			out.append(" }");
+		}
+	out.append(" ]");
+	std::cout << "sent " << rows << " rows from the snapshot\n";
+	return true;
+}
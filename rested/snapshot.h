@@ -0,0 +1,67 @@
+#pragma once
+
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+#include "pointers.h"
+#include "database.h"
+
+// An in-memory copy of a small, rarely written table, stored column by column
+// so that equality lookups are answered by scanning flat arrays instead of
+// running SQL. Rows reported changed by a finished write are reread from the
+// database before the next lookup.
+class Snapshot
+{
+public:
+	enum class Kind { Integer, Real, Text, Other };
+private:
+	using Word = uint64_t;
+
+	struct Column
+	{
+		std::string name;
+		std::string key;			// Quoted JSON key
+		Kind kind;
+		bool mixed = false;			// Holds values of another type, so lookups touching it go to SQL
+		std::vector<sqlite_int64> integers;
+		std::vector<double> reals;
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> lengths;
+		std::string arena;
+		std::vector<Word> nulls;
+	};
+
+	shared<db::Database> _db;
+	const std::string _table;
+
+	std::mutex _mutex;
+	std::vector<Column> _columns;
+	std::vector<sqlite_int64> _rowids;
+	std::vector<Word> _live;
+	std::unordered_map<sqlite_int64, size_t> _slots;
+	size_t _dead = 0;
+	size_t _garbage = 0;
+
+	// Filled by the listener; guarded separately so that a commit never
+	// waits on a reader that is itself waiting on the database
+	std::mutex _pending_mutex;
+	std::set<sqlite_int64> _pending;
+	bool _stale = true;
+
+	void _reload();
+	void _refresh();
+	size_t _append(sqlite_int64 rowid);
+	void _store(size_t slot, const db::Cursor& row);
+	const Column* _column(std::string_view name) const;
+public:
+	Snapshot(shared<db::Database> db, std::string table);
+
+	// Writes the rows matching all criteria as a JSON array, in id order. Returns
+	// false, leaving out untouched, when only SQL can answer: for anything but
+	// equality between a column and a value of its own type
+	bool select(const std::vector<std::string_view>& columns, const std::vector<db::Criterium>& criteria, std::string& out);
+};
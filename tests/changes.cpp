@@ -0,0 +1,92 @@
+#include "tests.h"
+
+#include <cstdio>
+#include <memory>
+
+#include "database.h"
+#include "cache.h"
+#include "snapshot.h"
+
+using namespace db;
+
+namespace
+{
+	shared<Database> open(const char* filename)
+	{
+		std::remove(filename);
+		auto db = std::make_shared<Database>(filename);
+		db->create("places", { integer("id").primaryKey(), text("name").notNull() }, {}).exec();
+		return db;
+	}
+
+	void insert(Database& db, std::string_view name)
+	{
+		const std::vector<std::string_view> columns{ "name" };
+		Query q = db.insert("places", columns);
+		q.bind(1, name);
+		db.exec(q);
+	}
+
+	// What a GET would serve and cache: the names, straight from SQL
+	std::string names(Database& db)
+	{
+		std::string result;
+		Query q = db.selectAll().from("places");
+		for (auto& row : q.cursor())
+			result.append(row.text(1)).append(";");
+		return result;
+	}
+
+	std::string snapshot(Snapshot& snapshot)
+	{
+		std::string out;
+		CHECK(snapshot.select({ "name" }, {}, out));
+		return out;
+	}
+}
+
+TEST(rolled_back_rows_are_not_served)
+{
+	auto db = open("tests-rollback.db");
+	ResultCache cache(1 << 20);
+	cache.watch(*db);
+	Snapshot places(db, "places");
+	const auto tag = ResultCache::tag(*db, "places");
+
+	insert(*db, "Town");
+	CHECK_EQUAL(snapshot(places), std::string("[ { \"name\": \"Town\" } ]"));
+	{
+		auto transaction = db->transaction();
+		insert(*db, "Ghost");
+
+		// A read on the same connection sees the row before it commits
+		const auto generation = cache.generation(tag);
+		const auto seen = names(*db);
+		CHECK_EQUAL(seen, std::string("Town;Ghost;"));
+		cache.insert("places", tag, std::nullopt, std::make_shared<const std::string>(seen), {}, generation);
+		CHECK_EQUAL(snapshot(places), std::string("[ { \"name\": \"Town\" } ]"));
+	}
+
+	CHECK(!cache.find("places"));
+	CHECK_EQUAL(names(*db), std::string("Town;"));
+	CHECK_EQUAL(snapshot(places), std::string("[ { \"name\": \"Town\" } ]"));
+}
+
+TEST(committed_rows_are_served_once_committed)
+{
+	auto db = open("tests-commit.db");
+	ResultCache cache(1 << 20);
+	cache.watch(*db);
+	Snapshot places(db, "places");
+	const auto tag = ResultCache::tag(*db, "places");
+
+	cache.insert("places", tag, std::nullopt, std::make_shared<const std::string>(names(*db)), {}, cache.generation(tag));
+	auto transaction = db->transaction();
+	insert(*db, "Town");
+	CHECK(cache.find("places"));
+	CHECK_EQUAL(snapshot(places), std::string("[  ]"));
+	transaction.commit();
+
+	CHECK(!cache.find("places"));
+	CHECK_EQUAL(snapshot(places), std::string("[ { \"name\": \"Town\" } ]"));
+}
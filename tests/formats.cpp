@@ -0,0 +1,58 @@
+#include "tests.h"
+
+#include <sstream>
+
+#include "binary.h"
+
+namespace
+{
+	// Writes what the parser reports as JSON text
+	class Recorder : public json::Handler
+	{
+	public:
+		std::string out;
+
+		void onNull() override { out += "null "; }
+		void onBool(bool value) override { out += value ? "true " : "false "; }
+		void onInteger(json::Integer value) override { out += std::to_string(value) + " "; }
+		void onNumber(double value) override { out += std::to_string(value) + " "; }
+		void onString(std::string_view text) override { out.append("\"").append(text).append("\" "); }
+		void onKey(std::string_view name) override { out.append(name).append(": "); }
+		void onBeginArray() override { out += "[ "; }
+		void onEndArray() override { out += "] "; }
+		void onBeginObject() override { out += "{ "; }
+		void onEndObject() override { out += "} "; }
+	};
+
+	std::string parse(const std::string& data, binary::Format format)
+	{
+		std::istringstream in(data);
+		Recorder recorder;
+		binary::parse(in, format, recorder);
+		return recorder.out;
+	}
+
+	// CBOR tag 1, an epoch time, around the value
+	std::string tagged(size_t tags, const std::string& value)
+	{
+		return std::string(tags, char(0xC1)) + value;
+	}
+}
+
+TEST(cbor_tags_are_skipped)
+{
+	CHECK_EQUAL(parse(tagged(1, "\x18\x2A"), binary::Format::Cbor), std::string("42 "));
+	CHECK_EQUAL(parse(tagged(3, "\x81\x01"), binary::Format::Cbor), std::string("[ 1 ] "));
+}
+
+TEST(cbor_tag_chains_count_against_the_depth)
+{
+	CHECK_THROWS(parse(tagged(100000, "\x01"), binary::Format::Cbor));
+	CHECK_THROWS(parse(tagged(300, std::string(300, char(0x81)) + "\x01"), binary::Format::Cbor));
+}
+
+TEST(nesting_past_the_limit_is_rejected)
+{
+	CHECK_THROWS(parse(std::string(100000, char(0x81)) + "\x01", binary::Format::Cbor));
+	CHECK_THROWS(parse(std::string(100000, char(0x91)) + "\x01", binary::Format::MessagePack));
+}
@@ -0,0 +1,20 @@
+#include "tests.h"
+
+int main()
+{
+	for (auto& test : tests::all())
+	{
+		const int before = tests::failures();
+		try
+		{
+			test.run();
+		}
+		catch (std::exception& e)
+		{
+			tests::fail(test.name, 0, std::string("threw ") + e.what());
+		}
+		std::cout << (tests::failures() == before ? "passed " : "FAILED ") << test.name << "\n";
+	}
+	std::cout << tests::all().size() << " tests, " << tests::failures() << " failures\n";
+	return tests::failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+#include "tests.h"
+
+#include <cstdio>
+#include <memory>
+
+#include "database.h"
+
+using namespace db;
+
+namespace
+{
+	size_t count(Query q)
+	{
+		size_t rows = 0;
+		for (auto& row : q.cursor())
+		{
+			(void)row;
+			++rows;
+		}
+		return rows;
+	}
+}
+
+TEST(statements_are_reused_once_released)
+{
+	std::remove("tests-statements.db");
+	Database db("tests-statements.db");
+	db.create("places", { integer("id").primaryKey(), text("name").notNull() }, {}).exec();
+
+	sqlite3_stmt* first;
+	{
+		Query q = db.selectAll().from("places");
+		first = q.get();
+	}
+	Query again = db.selectAll().from("places");
+	CHECK(again.get() == first);
+	Query meanwhile = db.selectAll().from("places");
+	CHECK(meanwhile.get() != first);
+}
+
+TEST(kept_statements_survive_schema_changes)
+{
+	std::remove("tests-schema.db");
+	Database db("tests-schema.db");
+	db.create("places", { integer("id").primaryKey(), text("name").notNull() }, {}).exec();
+	const std::vector<std::string_view> columns{ "name" };
+	{
+		Query q = db.insert("places", columns);
+		q.bind(1, std::string_view("Town"));
+		db.exec(q);
+	}
+	CHECK_EQUAL(count(db.selectAll().from("places").where({ equal("name", std::string("Town")) })), size_t(1));
+
+	db.create(index("places", { "name" })).exec();
+	CHECK_EQUAL(count(db.selectAll().from("places").where({ equal("name", std::string("Town")) })), size_t(1));
+}
+
+TEST(index_advice_waits_for_a_review)
+{
+	std::remove("tests-advice.db");
+	Database db("tests-advice.db");
+	db.create("places", { integer("id").primaryKey(), text("name").notNull() }, {}).exec();
+	db.adviseIndexes(true);
+	// Looked up over a connection of its own, which the advisor does not watch
+	Database schema("tests-advice.db");
+	auto indexes = [&] { return count(schema.selectAll().from("sqlite_master").where({ equal("type", std::string("index")) })); };
+
+	count(db.selectAll().from("places").where({ equal("name", std::string("Town")) }));
+	CHECK(db.advisor()->missing().empty());
+	CHECK_EQUAL(indexes(), size_t(0));
+
+	auto missing = db.advisor()->review(db);
+	CHECK_EQUAL(missing.size(), size_t(1));
+	CHECK_EQUAL(indexes(), size_t(1));
+	CHECK_EQUAL(db.advisor()->review(db).size(), size_t(1));
+}
+
+TEST(index_variants_are_named_apart)
+{
+	const auto plain = index("characters", { "place" }).name;
+	const auto covering = index("characters", { "place" }).covering({ "name" }).name;
+	const auto partial = index("characters", { "place" }).where("\"place\" > 1").name;
+	CHECK(plain != covering);
+	CHECK(plain != partial);
+	CHECK(partial != index("characters", { "place" }).where("\"place\" < 1").name);
+	const auto again = index("characters", { "place" }).where("\"place\" > 1").name;
+	CHECK_EQUAL(partial, again);
+}
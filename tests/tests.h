@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <functional>
+
+// Just enough of a test runner: TEST registers a function, CHECK reports a
+// failed condition with its location and carries on
+namespace tests
+{
+	struct Test
+	{
+		const char* name;
+		std::function<void()> run;
+	};
+
+	inline std::vector<Test>& all() { static std::vector<Test> tests; return tests; }
+	inline int& failures() { static int count = 0; return count; }
+
+	struct Register
+	{
+		Register(const char* name, std::function<void()> run) { all().push_back({ name, std::move(run) }); }
+	};
+
+	inline void fail(const char* file, int line, const std::string& what)
+	{
+		std::cout << file << "(" << line << "): " << what << "\n";
+		++failures();
+	}
+}
+
+#define TEST(name) \
+	static void name(); \
+	static tests::Register name##_registered(#name, name); \
+	static void name()
+
+#define CHECK(condition) \
+	do { if (!(condition)) tests::fail(__FILE__, __LINE__, "failed: " #condition); } while (false)
+
+#define CHECK_EQUAL(actual, expected) \
+	do { \
+		const auto& a_ = (actual); const auto& e_ = (expected); \
+		if (!(a_ == e_)) { std::ostringstream s_; s_ << #actual " is " << a_ << ", expected " << e_; tests::fail(__FILE__, __LINE__, s_.str()); } \
+	} while (false)
+
+#define CHECK_THROWS(expression) \
+	do { \
+		bool thrown_ = false; \
+		try { expression; } catch (std::exception&) { thrown_ = true; } \
+		if (!thrown_) tests::fail(__FILE__, __LINE__, "did not throw: " #expression); \
+	} while (false)